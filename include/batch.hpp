@@ -0,0 +1,66 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "jpeg_encoder.hpp"
+#include "png_decoder.hpp"
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct BatchOptions {
+    // Per image; every conversion runs on a single thread, the pool
+    // provides the parallelism
+    JPEGEncodeOptions encode;
+    PNGDecodeOptions decode;
+    unsigned threads = 0; // conversions at a time, 0 = one per hardware thread
+    // Output path for each input. {dir} is the input's directory and {name}
+    // its file name without the extension; a relative result is taken
+    // relative to outputDir, if set. Empty means "{name}.jpg" in outputDir,
+    // or next to the input without one.
+    std::string nameTemplate;
+    std::string outputDir;
+    bool verbose = false; // report every file, not just the failures
+    // Bytes the conversions running at once may need between them, by
+    // their estimated working sets; 0 = no limit
+    size_t memoryBudget = 0;
+};
+
+struct BatchResult {
+    size_t converted = 0;
+    std::vector<std::pair<std::string, std::string>> failures; // input, error
+    double seconds = 0;
+    size_t memoryBudget = 0;
+    size_t peakMemory = 0; // largest total estimate admitted at once
+};
+
+// Converts many PNGs in one process, spread over a WorkStealingPool. Each
+// file succeeds or fails on its own; failures are reported as they happen
+// and collected for the summary. With a memory budget, each file's working
+// set is estimated from its header first, and a file only starts once its
+// estimate fits next to those of the files already running.
+class BatchConverter {
+public:
+    // Expands directories to the .png files directly in them; other
+    // arguments are taken as file names
+    static std::vector<std::string> expandInputs(const std::vector<std::string>& arguments);
+    // File names one per line (or `separator`-terminated, e.g. '\0')
+    static std::vector<std::string> readList(std::istream& in, char separator);
+    static std::string outputName(const std::string& input, const BatchOptions& options);
+    
+    // Progress goes to `log`, failures to `errors`
+    static BatchResult run(const std::vector<std::string>& inputs, const BatchOptions& options,
+                           std::ostream& log, std::ostream& errors);
+    static void printSummary(const BatchResult& result, std::ostream& log);
+    
+    // Estimated peak memory of converting `input`, from its IHDR
+    static size_t workingSetBytes(const std::string& input, const BatchOptions& options);
+    
+private:
+    static void convert(const std::string& input, const std::string& output,
+                        const BatchOptions& options);
+};
+
+#endif // BATCH_HPP
@@ -1,40 +1,198 @@
 #ifndef DEFLATE_HPP
 #define DEFLATE_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
 class Deflate {
 public:
-    static std::vector<uint8_t> decompress(const std::vector<uint8_t>& data);
+    // A contiguous run of compressed input, e.g. one IDAT chunk payload
+    struct Span {
+        const uint8_t* data;
+        size_t size;
+    };
+    
+    // Inflates a zlib stream into a caller-provided buffer whose size is the
+    // exact decompressed size (known up front for PNG image data). Throws if
+    // the stream produces more or fewer bytes. The stream may be split over
+    // any number of spans; it is read in place.
+    static void inflate(const std::vector<Span>& input, uint8_t* output, size_t outputSize);
+    
+    // Same contract as inflate(), decoded on up to `threads` threads. The
+    // stream is cut into chunks whose first block boundary is guessed and
+    // decoded speculatively, with references into the unknown preceding
+    // window kept as markers until the window is known. Chunks whose guess
+    // does not line up with the preceding chunk are re-decoded from the real
+    // boundary, and small streams go straight to inflate().
+    static void inflateParallel(const std::vector<Span>& input, uint8_t* output,
+                                size_t outputSize, unsigned threads);
+    
+    class Stream;
     
 private:
+    // LSB-first bit reader over a 64-bit buffer. refill() tops the buffer up
+    // to at least 56 bits, so a caller can decode a whole length/distance
+    // pair with peekBits()/consumeBits() after a single refill. Input is a
+    // list of spans; the fast path reads within the current span and the
+    // slow path steps across span boundaries.
     struct BitReader {
-        const std::vector<uint8_t>& data;
-        size_t byte_pos;
-        int bit_pos;
+        const uint8_t* pos;
+        const uint8_t* end;
+        const Span* nextSpan;
+        const Span* lastSpan;
+        uint64_t bitBuffer;
+        int bitCount;
+        size_t overrun; // zero bytes fed in past the end of the input
+        size_t inputOffset; // stream offset of `end`
         
-        BitReader(const std::vector<uint8_t>& d) : data(d), byte_pos(0), bit_pos(0) {}
+        BitReader(const std::vector<Span>& input)
+            : pos(nullptr), end(nullptr), nextSpan(input.data()),
+              lastSpan(input.data() + input.size()), bitBuffer(0), bitCount(0), overrun(0),
+              inputOffset(0) {}
+        BitReader(const std::vector<Span>& input, size_t bitOffset);
+        
+        void refill() {
+            if (end - pos >= 8) {
+                bitBuffer |= loadLE64(pos) << bitCount;
+                pos += (63 - bitCount) >> 3;
+                bitCount |= 56;
+            } else {
+                refillSlow();
+            }
+        }
+        uint64_t peekBits(int count) const { return bitBuffer & ((uint64_t(1) << count) - 1); }
+        void consumeBits(int count) {
+            bitBuffer >>= count;
+            bitCount -= count;
+        }
         
         uint32_t readBits(int count);
-        uint32_t readBitsReverse(int count);
         void alignToByte();
-        bool hasData() const;
+        void readBytes(uint8_t* dst, size_t count);
+        bool nextInput();
+        void refillSlow();
+        void checkOverrun() const;
+        size_t bitPosition() const {
+            return (inputOffset - (end - pos) + overrun) * 8 - bitCount;
+        }
+    };
+    
+    static uint64_t loadLE64(const uint8_t* p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+        return value;
+#else
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+#endif
+    }
+    
+    // What a decoded table entry stands for. Length and distance symbols are
+    // resolved to their base value and extra-bit count at build time.
+    enum EntryKind : uint8_t {
+        kSymbol = 0,    // value is the plain symbol (literal byte, code length)
+        kBase = 1,      // value is a length/distance base, followed by extra bits
+        kEndOfBlock = 2,
+        kSubtable = 3,  // value is the subtable offset, bits its index width
+        kInvalid = 4
+    };
+    
+    struct HuffmanEntry {
+        uint16_t value;
+        uint8_t bits;   // code length to consume
+        uint8_t kind;
+        uint8_t extra;  // extra bits following a kBase symbol
     };
     
+    enum class TreeKind { CodeLength, LiteralLength, Distance };
+    
     struct HuffmanTree {
-        std::vector<int> codes;
-        std::vector<int> lengths;
-        int maxBits;
+        static constexpr int kPrimaryBits = 10;
         
-        HuffmanTree() : maxBits(0) {}
-        void build(const std::vector<int>& codeLengths);
-        int decode(BitReader& reader) const;
+        std::vector<HuffmanEntry> table;
+        bool complete = false; // every bit pattern decodes (or at most one code)
+        
+        void build(const std::vector<int>& codeLengths, TreeKind kind);
+        const HuffmanEntry& decode(BitReader& reader) const;
+    };
+    
+    // Longest match deflate can encode
+    static constexpr size_t kMaxMatch = 258;
+    
+    static const HuffmanTree& fixedLitLenTree();
+    static const HuffmanTree& fixedDistTree();
+    static void readDynamicTrees(BitReader& reader, HuffmanTree& litLen, HuffmanTree& dist);
+    static void copyMatch(uint8_t* dst, size_t distance, size_t length);
+    static void copyMatch(uint16_t* dst, size_t distance, size_t length);
+    template <typename T>
+    static bool decodeBlock(BitReader& reader, const HuffmanTree& litLen, const HuffmanTree& dist,
+                            T* output, size_t& outputPos, size_t outputSize, bool resumable);
+    
+    friend class InflateTest; // tests/inflate_test.cpp
+    
+    // inflateParallel() past its size checks, with the stream cut every
+    // `chunkBytes` compressed bytes; the stats show how the chunks went
+    struct ChunkStats {
+        size_t chunks = 0;    // making up the output
+        size_t redecoded = 0; // of those, decoded again from the real boundary
     };
+    static ChunkStats inflateChunked(const std::vector<Span>& input, uint8_t* output,
+                                     size_t outputSize, unsigned threads, size_t chunkBytes);
+    
+    struct Chunk;
+    static void decodeChunk(const std::vector<Span>& input, size_t startBit, size_t stopBit,
+                            size_t maxOutput, Chunk& chunk);
+    static bool isDynamicBlockStart(const uint8_t* data, size_t bit);
+    static void speculateChunk(const std::vector<Span>& input, size_t fromBit, size_t toBit,
+                               size_t stopBit, size_t maxOutput, Chunk& chunk);
+    static void resolveChunk(const Chunk& chunk, size_t from, size_t to, uint8_t* output);
+};
+
+// Incremental inflate of a zlib stream, for consumers that take the output a
+// piece at a time, e.g. one PNG scanline after another. Only the 32 KiB
+// window and a little lookahead are held, whatever the decompressed size.
+class Deflate::Stream {
+public:
+    // `input` is read in place and has to outlive the stream
+    explicit Stream(const std::vector<Span>& input);
+    
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+    
+    // The next `count` bytes of output; throws if the stream ends first
+    void read(uint8_t* dst, size_t count);
+    // Throws unless the stream ends right after the bytes read so far
+    void finish();
+    // Input before this point has been consumed for good
+    const uint8_t* inputPosition() const { return reader_.pos; }
+    
+private:
+    static constexpr size_t kWindowSize = 32768;
+    static constexpr size_t kBufferSize = 4 * kWindowSize;
+    
+    enum class State { BlockHeader, Stored, Compressed };
+    
+    BitReader reader_;
+    State state_;
+    bool finalBlock_;
+    size_t storedLeft_;              // in the current stored block
+    HuffmanTree litLen_, dist_;      // of the current dynamic block
+    const HuffmanTree* blockLitLen_; // trees the current block is coded with
+    const HuffmanTree* blockDist_;
+    
+    // Decoded output: the window the next back-references can reach, then
+    // the bytes not read yet, up to filled_
+    std::vector<uint8_t> buffer_;
+    size_t filled_;
+    size_t consumed_;
     
-    static void buildFixedTrees(HuffmanTree& litLen, HuffmanTree& dist);
-    static void decodeBlock(BitReader& reader, HuffmanTree& litLen, HuffmanTree& dist, 
-                           std::vector<uint8_t>& output);
+    void fill();
+    void makeRoom();
+    void decodeStep();
 };
 
-#endif // DEFLATE_HPP
\ No newline at end of file
+#endif // DEFLATE_HPP
@@ -1,7 +1,9 @@
 #ifndef IMAGE_HPP
 #define IMAGE_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <new>
 #include <vector>
 
 struct Pixel {
@@ -11,25 +13,58 @@ struct Pixel {
     Pixel(uint8_t red, uint8_t green, uint8_t blue) : r(red), g(green), b(blue) {}
 };
 
+// Allocator handing out storage aligned to `Alignment` bytes, for buffers
+// read with aligned vector loads
+template <typename T, size_t Alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+    
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+    
+    T* allocate(size_t count) {
+        return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment)));
+    }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+    
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+// 8-bit image stored as separate planes, one per channel (R, G, B, or a
+// single gray plane), with every row starting on a 64-byte boundary
 class Image {
 public:
-    Image() : width_(0), height_(0) {}
-    Image(uint32_t width, uint32_t height);
+    static constexpr size_t kRowAlignment = 64;
+    
+    Image() : width_(0), height_(0), channels_(0), stride_(0) {}
+    Image(uint32_t width, uint32_t height, int channels = 3);
     
-    void resize(uint32_t width, uint32_t height);
+    void resize(uint32_t width, uint32_t height, int channels = 3);
     
-    Pixel& at(uint32_t x, uint32_t y);
-    const Pixel& at(uint32_t x, uint32_t y) const;
+    // Bounds-checked single pixel access, for debugging and tests
+    Pixel at(uint32_t x, uint32_t y) const;
+    void set(uint32_t x, uint32_t y, const Pixel& pixel);
+    
+    // Unchecked access to row y of a channel plane, width() bytes long
+    uint8_t* row(int channel, uint32_t y) {
+        return planes_.data() + (size_t(channel) * height_ + y) * stride_;
+    }
+    const uint8_t* row(int channel, uint32_t y) const {
+        return planes_.data() + (size_t(channel) * height_ + y) * stride_;
+    }
     
     uint32_t width() const { return width_; }
     uint32_t height() const { return height_; }
-    
-    const std::vector<Pixel>& pixels() const { return pixels_; }
+    int channels() const { return channels_; }
     
 private:
     uint32_t width_;
     uint32_t height_;
-    std::vector<Pixel> pixels_;
+    int channels_;
+    size_t stride_;
+    std::vector<uint8_t, AlignedAllocator<uint8_t, kRowAlignment>> planes_;
 };
 
-#endif // IMAGE_HPP
\ No newline at end of file
+#endif // IMAGE_HPP
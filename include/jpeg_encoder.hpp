@@ -1,50 +1,325 @@
-#ifndef JPEG_ENCODER_HPP
-#define JPEG_ENCODER_HPP
-
-#include "image.hpp"
-#include <cstdint>
-#include <vector>
-#include <string>
-
-class JPEGEncoder {
-public:
-    static void encode(const Image& image, const std::string& filename, int quality = 85);
-
-private:
-    class BitWriter {
-    public:
-        BitWriter(std::vector<uint8_t>& out) : output(out), buffer(0), bitCount(0) {}
-        void writeBits(uint16_t bits, int count);
-        void flush();
-    private:
-        std::vector<uint8_t>& output;
-        uint32_t buffer;
-        int bitCount;
-    };
-
-    static const int ZIGZAG[64];
-    static int luminanceQuantTable[64];
-    static int chrominanceQuantTable[64];
-
-    static void rgbToYCbCr(uint8_t r, uint8_t g, uint8_t b,
-                           float& y, float& cb, float& cr);
-    static void forwardDCT(float block[8][8]);
-    static void quantize(float block[8][8], const int quantTable[64], int output[64]);
-
-    static void writeMarker(std::vector<uint8_t>& out, uint8_t marker);
-    static void writeAPP0(std::vector<uint8_t>& out);
-    static void writeDQT(std::vector<uint8_t>& out, const int table[64], int tableId);
-    static void writeSOF0(std::vector<uint8_t>& out, uint32_t width, uint32_t height);
-    static void writeDHT(std::vector<uint8_t>& out, const uint8_t* bits,
-                         const uint8_t* values, int tcth, int count);
-    static void writeSOS(std::vector<uint8_t>& out);
-
-    static int getCategory(int value);
-    static void generateHuffmanCodes(const uint8_t* bits, const uint8_t* values,
-                                     uint16_t* codes, uint8_t* sizes);
-    static void encodeBlock(BitWriter& writer, int block[64], int& prevDC,
-                            const uint8_t* dcBits, const uint8_t* dcValues,
-                            const uint8_t* acBits, const uint8_t* acValues);
-};
-
-#endif // JPEG_ENCODER_HPP
+#ifndef JPEG_ENCODER_HPP
+#define JPEG_ENCODER_HPP
+
+#include "image.hpp"
+#include "output_stream.hpp"
+#include "scanline.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+
+enum class DCTMethod {
+    Float,  // AAN factored transform in single precision
+    Integer // bit-exact 32-bit fixed-point transform, same output everywhere
+};
+
+enum class ChromaSubsampling {
+    S444, // full resolution chroma
+    S422, // chroma halved horizontally
+    S420  // chroma halved in both directions
+};
+
+struct JPEGEncodeOptions {
+    int quality = 85; // 1-100
+    DCTMethod dct = DCTMethod::Float;
+    ChromaSubsampling subsampling = ChromaSubsampling::S420;
+    // Skip DCT work on blocks whose high frequencies are proven to quantize
+    // to zero (float DCT only); pays off at lower qualities
+    bool pruneDCT = false;
+    // Gather symbol statistics over the whole image and code it with
+    // Huffman tables built from them instead of the Annex K ones
+    bool optimizeHuffman = false;
+    // Write a single-component (Y only) JPEG even for color input; gray
+    // input always is
+    bool grayscale = false;
+    // Emit a restart marker every this many MCU rows (0 = none). Each
+    // restart interval is then coded on its own, on up to `threads` threads.
+    // Without restart markers, more than one thread pipelines the transform
+    // into a single entropy coder; the output is the same as with one.
+    unsigned restartRows = 0;
+    unsigned threads = 1; // 0 = one per hardware thread
+};
+
+class JPEGEncoder {
+public:
+    static void encode(const Image& image, const std::string& filename,
+                       const JPEGEncodeOptions& options = JPEGEncodeOptions());
+    // Writes to `out` and flushes it, leaving it open
+    static void encode(const Image& image, OutputStream& out,
+                       const JPEGEncodeOptions& options = JPEGEncodeOptions());
+    
+    class ScanlineEncoder;
+
+private:
+    friend class DCTTest; // tests/dct_test.cpp
+    
+    // Entropy-coded segment writer. Bits collect in a 64-bit accumulator and
+    // go out 32 at a time; the 0xFF byte stuffing is only done bytewise for
+    // the rare words that contain an 0xFF.
+    class BitWriter {
+    public:
+        BitWriter(std::vector<uint8_t>& out) : output(out), pos(0), buffer(0), bitCount(0) {}
+        // Starts writing at the end of `out`, with room for `expected` bytes
+        void start(size_t expected);
+        // Up to 32 bits at a time, e.g. a Huffman code and its magnitude bits
+        void writeBits(uint32_t bits, int count) {
+            buffer = (buffer << count) | bits;
+            bitCount += count;
+            if (bitCount >= 32) {
+                flushWord();
+            }
+        }
+        // Pads to a byte boundary and trims `out` to the data written
+        void flush();
+        // Bytes written so far; discard() drops them once they have been
+        // passed on, keeping the bits that do not make a byte yet
+        size_t size() const { return pos; }
+        void discard() { pos = 0; }
+    private:
+        void flushWord();
+        
+        std::vector<uint8_t>& output;
+        size_t pos;
+        uint64_t buffer;
+        int bitCount;
+    };
+
+    static const int ZIGZAG[64];
+    static int luminanceQuantTable[64];
+    static int chrominanceQuantTable[64];
+
+    // Converts a row of separate R, G, B samples to level-shifted Y, Cb, Cr
+    // in 16-bit fixed point, rounding like IJG libjpeg. With `sumPairs`, cb
+    // and cr instead get the sums of horizontally adjacent pairs,
+    // (width + 1) / 2 of them; an odd last pixel counts twice.
+    static void rgbToYCbCr(const uint8_t* r, const uint8_t* g, const uint8_t* b,
+                           int16_t* y, int16_t* cb, int16_t* cr, uint32_t width, bool sumPairs);
+    // Luma only, for grayscale output
+    static void rgbToY(const uint8_t* r, const uint8_t* g, const uint8_t* b, int16_t* y,
+                       uint32_t width);
+    
+    // Scaled quantization table in natural order, with the transform output
+    // scaling folded into the divisors each DCT method quantizes with
+    struct QuantTable {
+        int values[64];        // as written to DQT
+        float reciprocals[64]; // forwardDCTFloat
+        int32_t divisors[64];  // forwardDCTInt
+        // Pruned transform: energy left outside the DC, or outside the
+        // top-left 4x4 coefficients, below which all the rest quantize to
+        // zero; 0 when the steps are too fine for the level to pay off
+        float dcOnlyLimit;
+        float low4x4Limit;
+    };
+    
+    static void buildQuantTable(const int baseTable[64], int quality, QuantTable& table);
+    static void forwardDCTFloat(float block[64]);
+    static void forwardDCTInt(int32_t block[64]);
+    static void quantizeFloat(const float block[64], const QuantTable& table, int output[64]);
+    static void quantizeInt(const int32_t block[64], const QuantTable& table, int output[64]);
+    // DCT and quantize `count` horizontally adjacent blocks whose rows are
+    // `stride` samples apart, writing 64 zigzag-ordered coefficients per block.
+    // With `prune`, blocks proven to only have low-frequency coefficients
+    // left after quantization skip the rest of the transform. masks[b] gets
+    // the nonzeroMask() of block b.
+    static void transformBlocksFloat(const int16_t* samples, size_t stride, uint32_t count,
+                                     const QuantTable& table, bool prune, int* output,
+                                     uint64_t* masks);
+    // Bit i set where zigzag coefficient i is nonzero
+    static uint64_t nonzeroMask(const int block[64]);
+
+    static void writeMarker(std::vector<uint8_t>& out, uint8_t marker);
+    static void writeAPP0(std::vector<uint8_t>& out);
+    static void writeDQT(std::vector<uint8_t>& out, const int table[64], int tableId);
+    // `components` is 1 (Y) or 3 (YCbCr); Y is sampled hFactor x vFactor
+    // times as densely as Cb and Cr
+    static void writeSOF0(std::vector<uint8_t>& out, uint32_t width, uint32_t height,
+                          int components, int hFactor, int vFactor);
+    
+    // Huffman table in DHT form (code counts per length, then the symbols)
+    // together with the code and length of every symbol for emission
+    struct HuffmanTable {
+        uint8_t bits[16];
+        uint8_t values[256];
+        int count;
+        uint16_t codes[256];
+        uint8_t sizes[256];
+    };
+    
+    static void writeDHT(std::vector<uint8_t>& out, const HuffmanTable& table, int tcth);
+    static void writeSOS(std::vector<uint8_t>& out, int components);
+    static void writeDRI(std::vector<uint8_t>& out, uint32_t interval);
+
+    static int getCategory(int value);
+    static void buildHuffmanTable(const uint8_t* bits, const uint8_t* values, HuffmanTable& table);
+    // Optimal code with lengths limited to 16 bits (Annex K.2) for the
+    // symbol frequencies freq[0..255]; freq is used as scratch
+    static void buildOptimalHuffmanTable(uint64_t freq[257], HuffmanTable& table);
+    // Counts the symbols encodeBlock() would emit for the block
+    static void countBlock(const int block[64], uint64_t mask, int& prevDC, uint64_t* dcFreq,
+                           uint64_t* acFreq);
+    static void encodeBlock(BitWriter& writer, const int block[64], uint64_t mask, int& prevDC,
+                            const HuffmanTable& dc, const HuffmanTable& ac);
+};
+
+// Encodes rows as they are handed over, e.g. by PNGDecoder::decode, so the
+// image never has to exist as a whole. Each row is converted straight into
+// level-shifted Y/Cb/Cr planes of a strip one MCU high, and every full strip
+// is transformed and entropy coded, and the coded data written out as it
+// comes (with optimizeHuffman, the first pass keeps the coefficients of the
+// whole image). A file abandoned before end() is removed.
+class JPEGEncoder::ScanlineEncoder : public ScanlineSink {
+public:
+    // Creates `filename` ("-" for stdout) in begin() and closes it in end()
+    ScanlineEncoder(const std::string& filename,
+                    const JPEGEncodeOptions& options = JPEGEncodeOptions());
+    // Writes to the caller's stream; end() flushes it but leaves it open
+    ScanlineEncoder(OutputStream& out, const JPEGEncodeOptions& options = JPEGEncodeOptions());
+    ~ScanlineEncoder();
+    
+    void begin(const ScanlineFormat& format) override;
+    void row(uint32_t y, const uint8_t* samples) override;
+    void end() override;
+    
+    // Same as row(), from separate R, G and B planes
+    void rowPlanar(const uint8_t* r, const uint8_t* g, const uint8_t* b);
+    
+    uint32_t width() const { return width_; }
+    uint32_t height() const { return height_; }
+    
+    // Rough peak memory of encoding an image of this format, from the same
+    // strip geometry begin() sets up
+    static size_t workingSetBytes(const ScanlineFormat& format,
+                                  const JPEGEncodeOptions& options = JPEGEncodeOptions());
+    
+private:
+    // Quantized blocks of one strip and their nonzeroMask()s, per component;
+    // every coding thread has its own
+    struct StripBuffers {
+        std::vector<int> coefficients[3];
+        std::vector<uint64_t> masks[3];
+    };
+    
+    // The strips between two restart markers (the whole image without
+    // restart intervals), and the entropy coder state that runs through them
+    struct Segment {
+        Segment() : writer(data) {}
+        
+        // Strips of stripHeight_ rows of level-shifted samples per component,
+        // paddedWidth_ or chromaWidth_ wide. Until downsampleChroma() runs,
+        // each chroma sample is the sum of the 1 << hShift_ pixels it covers.
+        std::vector<int16_t> samples[3];
+        uint32_t strips = 0;
+        
+        std::vector<uint8_t> data; // entropy-coded, without markers
+        BitWriter writer;
+        int prevDC[3] = {};
+        
+        // With optimizeHuffman the first pass only counts symbols and keeps
+        // the blocks, in coding order, as their mask and nonzero coefficients
+        uint64_t dcFreq[2][257] = {};
+        uint64_t acFreq[2][257] = {};
+        std::vector<uint64_t> bufferedMasks;
+        std::vector<int16_t> bufferedValues;
+        
+        StripBuffers blocks; // when pipelined_, the transformed strip
+        
+        bool done = false; // under mutex_ once handed to the workers
+        std::exception_ptr error;
+    };
+    
+    std::string filename_;
+    JPEGEncodeOptions options_;
+    uint32_t width_;
+    uint32_t height_;
+    int channels_;
+    int components_;       // in the JPEG: 1 for grayscale, else 3
+    uint32_t paddedWidth_; // luma, a whole number of MCUs
+    uint32_t chromaWidth_; // paddedWidth_ after subsampling
+    int hShift_;           // log2 of the luma blocks per MCU across
+    int vShift_;           // and down
+    uint32_t stripHeight_; // rows per MCU
+    uint32_t restartRows_; // strips per Segment, 0 for a single one
+    bool pipelined_;       // one-strip Segments, coded in order into scan_
+    QuantTable lumQuant_;
+    QuantTable chromQuant_;
+    HuffmanTable dcLum_, acLum_, dcChrom_, acChrom_;
+    
+    std::unique_ptr<OutputStream> ownOutput_; // opened from filename_
+    OutputStream* out_;
+    std::vector<uint8_t> output_; // markers not written to out_ yet
+    uint32_t segmentsWritten_;
+    
+    std::unique_ptr<Segment> current_; // receiving rows
+    uint32_t stripRows_;               // rows in current_'s last strip
+    StripBuffers buffers_;             // for strips coded on this thread
+    std::unique_ptr<Segment> spare_;   // retired, to reuse its samples
+    
+    // Segments handed over, oldest first; with workers, the ones not yet
+    // picked up are also in queue_. With optimizeHuffman, segments through
+    // the first pass wait in firstPass_ for the tables.
+    std::deque<std::unique_ptr<Segment>> pending_;
+    std::vector<std::unique_ptr<Segment>> firstPass_;
+    std::deque<Segment*> queue_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable segmentDone_;
+    bool stopping_;
+    
+    // Pipelined mode: a fixed ring of strip Segments goes round from free_
+    // (rows arriving) through pending_ (being transformed) to coder_, which
+    // entropy codes them in order into scan_ and frees them again
+    std::unique_ptr<Segment> scan_;
+    std::deque<std::unique_ptr<Segment>> free_;
+    std::thread coder_;
+    std::condition_variable slotFree_;
+    bool inputDone_;
+    std::exception_ptr pipelineError_;
+    
+    // Interleaved input rows are split into planes_ for the color conversion
+    std::vector<uint8_t> planes_[3];
+    void (*split_)(const uint8_t* src, uint8_t* r, uint8_t* g, uint8_t* b, uint32_t width);
+    
+    template <int Channels>
+    static void splitRow(const uint8_t* src, uint8_t* r, uint8_t* g, uint8_t* b, uint32_t width);
+    uint32_t stripWidth(int component) const { return component ? chromaWidth_ : paddedWidth_; }
+    int16_t* rowSamples(int component) const;
+    void grayRow(const uint8_t* gray);
+    void finishRow();
+    void finishStrip();
+    void startScan();
+    
+    std::unique_ptr<Segment> newSegment();
+    void allocate(StripBuffers& buffers) const;
+    size_t expectedBytes(uint32_t strips) const;
+    void submit();
+    void retireOldest();
+    void appendSegment(Segment& segment);
+    void writeOutput();
+    void drainScan(Segment& segment);
+    void workerLoop();
+    void coderLoop();
+    void stopWorkers();
+    
+    void encodeSegment(Segment& segment, StripBuffers& buffers) const;
+    void downsampleChroma(int16_t* cb, int16_t* cr) const;
+    void encodeStrip(Segment& segment, uint32_t strip, StripBuffers& buffers) const;
+    void transformStrip(Segment& segment, uint32_t strip, StripBuffers& buffers) const;
+    // Entropy codes (or buffers) a transformed strip in MCU order
+    void codeStrip(Segment& coder, const StripBuffers& buffers) const;
+    void codeBlock(Segment& segment, const StripBuffers& buffers, int component,
+                   uint32_t index) const;
+    void bufferBlock(Segment& segment, const int block[64], uint64_t mask, int component) const;
+    void encodeBuffered(Segment& segment) const;
+    // One 8-row band of blocks, `stride` samples wide
+    void transformBand(const int16_t* samples, uint32_t stride, const QuantTable& table,
+                       int* output, uint64_t* masks) const;
+};
+
+#endif // JPEG_ENCODER_HPP
@@ -0,0 +1,38 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. Regular files are memory-mapped where the
+// platform supports it; anything else is read with a single sized read, or
+// until EOF. The name "-" is standard input.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    
+    // Lets the whole pages within [begin, end) go from memory, for a
+    // sequential reader to keep its footprint down; they are read in again
+    // if touched. Only mapped files release anything.
+    void release(const uint8_t* begin, const uint8_t* end);
+    
+private:
+    const uint8_t* data_;
+    size_t size_;
+    bool mapped_;
+    std::vector<uint8_t> buffer_;
+    
+    void readAll(const std::string& filename);
+    void readStdin();
+};
+
+#endif // MAPPED_FILE_HPP
@@ -0,0 +1,59 @@
+#ifndef OUTPUT_STREAM_HPP
+#define OUTPUT_STREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Buffered destination for encoded bytes. Writes collect in a fixed-size
+// buffer that goes out with write(2) (stdio where that is missing) each time
+// it fills, so output flows as it is produced and never needs room for the
+// whole file. A regular file is written under a temporary name in the same
+// directory and only replaces `filename` in close(). The name "-" is
+// standard output.
+class OutputStream {
+public:
+    explicit OutputStream(const std::string& filename);
+    // A file that was not close()d is incomplete; it is removed and any
+    // existing file by that name is left alone
+    ~OutputStream();
+    
+    OutputStream(const OutputStream&) = delete;
+    OutputStream& operator=(const OutputStream&) = delete;
+    
+    void write(const uint8_t* data, size_t size) {
+        if (size <= buffer_.size() - used_) {
+            std::memcpy(buffer_.data() + used_, data, size);
+            used_ += size;
+        } else {
+            writeSlow(data, size);
+        }
+    }
+    
+    // Hands the buffered bytes to the operating system
+    void flush();
+    // Flushes, closes and moves the file into place; throws if anything
+    // could not be written
+    void close();
+    
+    const std::string& name() const { return filename_; }
+    
+private:
+    static constexpr size_t kBufferSize = 64 * 1024;
+    
+    std::string filename_;
+    std::string tempName_; // written to until close(), empty if none
+    int fd_;              // -1 once closed
+    std::FILE* file_;     // without POSIX I/O
+    bool isStdout_;
+    std::vector<uint8_t> buffer_;
+    size_t used_;
+    
+    void writeSlow(const uint8_t* data, size_t size);
+    void writeAll(const uint8_t* data, size_t size);
+};
+
+#endif // OUTPUT_STREAM_HPP
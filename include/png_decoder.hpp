@@ -2,15 +2,35 @@
 #define PNG_DECODER_HPP
 
 #include "image.hpp"
+#include "deflate.hpp"
+#include "scanline.hpp"
 #include <string>
 #include <vector>
 #include <cstdint>
 
+class MappedFile;
+
+struct PNGDecodeOptions {
+    // Inflate large IDAT streams on several threads (Deflate::inflateParallel)
+    bool parallelInflate = false;
+    unsigned threads = 0; // 0 = one per hardware thread
+};
+
 class PNGDecoder {
 public:
-    static Image decode(const std::string& filename);
+    static Image decode(const std::string& filename,
+                        const PNGDecodeOptions& options = PNGDecodeOptions());
+    
+    // Streams the image to `sink` row by row as the scanlines are inflated
+    // and unfiltered, without building an Image. Only two scanlines and the
+    // inflate window are held, unless options.parallelInflate asks for the
+    // whole image to be inflated up front.
+    static void decode(const std::string& filename, ScanlineSink& sink,
+                       const PNGDecodeOptions& options = PNGDecodeOptions());
+    // Same, from an input already opened, e.g. standard input ("-")
+    static void decode(MappedFile& input, ScanlineSink& sink,
+                       const PNGDecodeOptions& options = PNGDecodeOptions());
     
-private:
     struct PNGHeader {
         uint32_t width;
         uint32_t height;
@@ -21,13 +41,39 @@ private:
         uint8_t interlace;
     };
     
+    // Reads just the signature and IHDR, to size an image up before
+    // decoding it
+    static PNGHeader readHeader(const std::string& filename);
+    // What decode() passes to the sink's begin(); throws if decode() would
+    // reject the image
+    static ScanlineFormat scanlineFormat(const PNGHeader& header);
+    // Rough peak memory of decode() into a sink for a `fileSize` byte PNG
+    // with this header, not counting the sink; throws if decode() would
+    // reject it
+    static size_t workingSetBytes(const PNGHeader& header, uint64_t fileSize,
+                                  const PNGDecodeOptions& options = PNGDecodeOptions());
+    
+private:
     static uint32_t readBigEndian32(const uint8_t* data);
-    static bool verifySignature(const std::vector<uint8_t>& data);
-    static PNGHeader parseIHDR(const std::vector<uint8_t>& data, size_t offset);
-    static std::vector<uint8_t> extractIDATData(const std::vector<uint8_t>& data);
-    static void unfilterScanlines(std::vector<uint8_t>& rawData, uint32_t width, 
-                                  uint32_t height, int bytesPerPixel);
-    static uint8_t paethPredictor(int a, int b, int c);
+    static bool verifySignature(const uint8_t* data, size_t size);
+    static PNGHeader parseIHDR(const uint8_t* data, size_t size);
+    static std::vector<Deflate::Span> findIDATChunks(const MappedFile& file);
+    
+    // Unfilter loops instantiated per (color type, bit depth), so pixel sizes
+    // are compile-time constants; picked once per image
+    struct FormatHandler {
+        uint8_t colorType;
+        uint8_t bitDepth;
+        int bytesPerPixel;
+        int channels;
+        void (*unfilter)(uint8_t filterType, uint8_t* row, const uint8_t* prev, size_t rowBytes);
+    };
+    
+    static const FormatHandler* findFormat(uint8_t colorType, uint8_t bitDepth);
+    // The handler for an image decode() supports; throws for anything else
+    static const FormatHandler* checkHeader(const PNGHeader& header);
+    template <int Bpp>
+    static void unfilterRow(uint8_t filterType, uint8_t* row, const uint8_t* prev, size_t rowBytes);
 };
 
 #endif // PNG_DECODER_HPP
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef SCANLINE_HPP
+#define SCANLINE_HPP
+
+#include <cstdint>
+
+// Layout of the rows handed to a ScanlineSink: `channels` interleaved 8-bit
+// samples per pixel, i.e. gray (1), gray + alpha (2), RGB (3) or RGBA (4)
+struct ScanlineFormat {
+    uint32_t width;
+    uint32_t height;
+    int channels;
+};
+
+// Consumer of decoded image rows. Rows arrive top to bottom, each one as soon
+// as it has been reconstructed, and are only valid during the call.
+class ScanlineSink {
+public:
+    virtual ~ScanlineSink() {}
+
+    virtual void begin(const ScanlineFormat& format) = 0;
+    virtual void row(uint32_t y, const uint8_t* samples) = 0;
+    virtual void end() {}
+};
+
+#endif // SCANLINE_HPP
@@ -0,0 +1,58 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own deque of tasks. A worker
+// runs its own tasks from the front and, once they run out, steals from the
+// back of the others', so one worker stuck on a long task does not hold up
+// the short ones queued behind it.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads); // 0 = one per hardware thread
+    // Waits for the queued tasks
+    ~WorkStealingPool();
+    
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    
+    // Queues `task` on the next worker, round robin
+    void submit(std::function<void()> task);
+    // Blocks until every task submitted so far has run. Tasks are meant to
+    // handle their own errors; the first exception one lets out is
+    // rethrown here.
+    void wait();
+    
+    unsigned size() const { return static_cast<unsigned>(threads_.size()); }
+    
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    unsigned nextQueue_;
+    
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable allDone_;
+    size_t queued_;    // in some deque
+    size_t unfinished_; // submitted and not run to the end yet
+    bool stopping_;
+    std::exception_ptr error_;
+    
+    void workerLoop(unsigned index);
+    bool take(unsigned index, std::function<void()>& task);
+};
+
+#endif // THREAD_POOL_HPP
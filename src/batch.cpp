@@ -0,0 +1,265 @@
+#include "batch.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+static std::string formatSize(size_t bytes) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (bytes < (size_t(1) << 20)) {
+        out << bytes / 1024.0 << " KiB";
+    } else {
+        out << bytes / 1048576.0 << " MiB";
+    }
+    return out.str();
+}
+
+std::vector<std::string> BatchConverter::expandInputs(const std::vector<std::string>& arguments) {
+    std::vector<std::string> inputs;
+    for (const std::string& argument : arguments) {
+        std::error_code error;
+        if (!fs::is_directory(argument, error)) {
+            inputs.push_back(argument);
+            continue;
+        }
+        
+        // In name order, so runs over the same directory go the same way
+        std::vector<std::string> files;
+        for (const fs::directory_entry& entry : fs::directory_iterator(argument)) {
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            if (extension == ".png" && entry.is_regular_file(error)) {
+                files.push_back(entry.path().string());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        inputs.insert(inputs.end(), files.begin(), files.end());
+    }
+    return inputs;
+}
+
+std::vector<std::string> BatchConverter::readList(std::istream& in, char separator) {
+    std::vector<std::string> names;
+    std::string name;
+    while (std::getline(in, name, separator)) {
+        if (separator == '\n' && !name.empty() && name.back() == '\r') {
+            name.pop_back();
+        }
+        if (!name.empty()) {
+            names.push_back(name);
+        }
+    }
+    return names;
+}
+
+std::string BatchConverter::outputName(const std::string& input, const BatchOptions& options) {
+    std::string pattern = options.nameTemplate;
+    if (pattern.empty()) {
+        pattern = options.outputDir.empty() ? "{dir}/{name}.jpg" : "{name}.jpg";
+    }
+    
+    fs::path path(input);
+    std::string dir = path.parent_path().string();
+    const std::pair<std::string, std::string> fields[] = {
+        {"{dir}", dir.empty() ? "." : dir},
+        {"{name}", path.stem().string()},
+    };
+    std::string result;
+    for (size_t pos = 0; pos < pattern.size();) {
+        bool replaced = false;
+        for (const auto& field : fields) {
+            if (pattern.compare(pos, field.first.size(), field.first) == 0) {
+                result += field.second;
+                pos += field.first.size();
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced) {
+            result += pattern[pos++];
+        }
+    }
+    
+    fs::path output(result);
+    if (!options.outputDir.empty() && output.is_relative()) {
+        output = fs::path(options.outputDir) / output;
+    }
+    return output.string();
+}
+
+size_t BatchConverter::workingSetBytes(const std::string& input, const BatchOptions& options) {
+    PNGDecoder::PNGHeader header = PNGDecoder::readHeader(input);
+    ScanlineFormat format = PNGDecoder::scanlineFormat(header);
+    return PNGDecoder::workingSetBytes(header, fs::file_size(input), options.decode) +
+           JPEGEncoder::ScanlineEncoder::workingSetBytes(format, options.encode);
+}
+
+void BatchConverter::convert(const std::string& input, const std::string& output,
+                             const BatchOptions& options) {
+    // A template may spread the outputs over directories of their own
+    fs::path parent = fs::path(output).parent_path();
+    std::error_code error;
+    if (!parent.empty() && !fs::is_directory(parent, error)) {
+        fs::create_directories(parent, error);
+    }
+    
+    JPEGEncoder::ScanlineEncoder encoder(output, options.encode);
+    PNGDecoder::decode(input, encoder, options.decode);
+}
+
+BatchResult BatchConverter::run(const std::vector<std::string>& inputs, const BatchOptions& options,
+                                std::ostream& log, std::ostream& errors) {
+    auto start = std::chrono::steady_clock::now();
+    BatchResult result;
+    
+    if (!options.outputDir.empty()) {
+        std::error_code error;
+        fs::create_directories(options.outputDir, error);
+        if (error) {
+            throw std::runtime_error("Cannot create output directory: " + options.outputDir);
+        }
+    }
+    
+    // One thread per conversion; the pool runs as many at a time as it has
+    // workers
+    BatchOptions single = options;
+    single.encode.threads = 1;
+    single.decode.threads = 1;
+    
+    std::mutex mutex; // result and the streams
+    auto fail = [&](const std::string& input, const std::string& error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        errors << "Error: " << input << ": " << error << "\n";
+        result.failures.emplace_back(input, error);
+    };
+    
+    // Two inputs mapping to one output would overwrite each other
+    std::unordered_set<std::string> outputs;
+    std::vector<std::pair<std::string, std::string>> jobs; // input, output
+    for (const std::string& input : inputs) {
+        std::string output = outputName(input, options);
+        if (!outputs.insert(output).second) {
+            fail(input, "Output name already used by another input: " + output);
+            continue;
+        }
+        jobs.emplace_back(input, output);
+    }
+    
+    auto convertJob = [&](const std::string& input, const std::string& output) {
+        try {
+            convert(input, output, single);
+        } catch (const std::exception& e) {
+            fail(input, e.what());
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        result.converted++;
+        if (options.verbose) {
+            log << "Converted " << input << " -> " << output << "\n";
+        }
+    };
+    
+    WorkStealingPool pool(options.threads);
+    if (options.memoryBudget == 0) {
+        for (const auto& job : jobs) {
+            pool.submit([&, job]() { convertJob(job.first, job.second); });
+        }
+        pool.wait();
+    } else {
+        result.memoryBudget = options.memoryBudget;
+        
+        // Unreadable headers fail here, with the decoder's message, and so
+        // does an image that would not fit even with nothing else running
+        std::multimap<size_t, std::pair<std::string, std::string>> waiting;
+        for (const auto& job : jobs) {
+            size_t estimate;
+            try {
+                estimate = workingSetBytes(job.first, single);
+            } catch (const std::exception& e) {
+                fail(job.first, e.what());
+                continue;
+            }
+            if (estimate > options.memoryBudget) {
+                fail(job.first, "Needs about " + formatSize(estimate) + ", more than the " +
+                                formatSize(options.memoryBudget) + " memory budget");
+                continue;
+            }
+            waiting.emplace(estimate, job);
+        }
+        
+        // Admit the largest job that fits in what is left of the budget, so
+        // the big ones start early and the small ones fill the gaps they
+        // leave. Any single job fits once nothing runs, so this always
+        // makes progress.
+        std::condition_variable released;
+        size_t inUse = 0;
+        unsigned running = 0;
+        while (!waiting.empty()) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto next = waiting.end();
+            released.wait(lock, [&]() {
+                if (running == pool.size()) {
+                    return false;
+                }
+                next = waiting.upper_bound(options.memoryBudget - inUse);
+                return next != waiting.begin();
+            });
+            --next;
+            size_t estimate = next->first;
+            auto job = std::move(next->second);
+            waiting.erase(next);
+            inUse += estimate;
+            running++;
+            result.peakMemory = std::max(result.peakMemory, inUse);
+            lock.unlock();
+            
+            pool.submit([&, job, estimate]() {
+                convertJob(job.first, job.second);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    inUse -= estimate;
+                    running--;
+                }
+                released.notify_one();
+            });
+        }
+        pool.wait();
+    }
+    
+    std::sort(result.failures.begin(), result.failures.end());
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void BatchConverter::printSummary(const BatchResult& result, std::ostream& log) {
+    size_t total = result.converted + result.failures.size();
+    log << "Converted " << result.converted << " of " << total << " files in " << std::fixed
+        << std::setprecision(2) << result.seconds << " s";
+    if (result.seconds > 0) {
+        log << " (" << std::setprecision(1) << result.converted / result.seconds << " files/s)";
+    }
+    log << "\n";
+    if (result.memoryBudget > 0) {
+        log << "Peak estimated memory: " << formatSize(result.peakMemory) << " of "
+            << formatSize(result.memoryBudget) << " budget\n";
+    }
+    
+    if (!result.failures.empty()) {
+        log << result.failures.size() << " failed:\n";
+        for (const auto& failure : result.failures) {
+            log << "  " << failure.first << ": " << failure.second << "\n";
+        }
+    }
+}
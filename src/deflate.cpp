@@ -1,171 +1,439 @@
 #include "deflate.hpp"
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
 
-uint32_t Deflate::BitReader::readBits(int count) {
-    uint32_t result = 0;
-    for (int i = 0; i < count; i++) {
-        if (byte_pos >= data.size()) {
-            throw std::runtime_error("Unexpected end of data");
-        }
-        result |= ((data[byte_pos] >> bit_pos) & 1) << i;
-        bit_pos++;
-        if (bit_pos == 8) {
-            bit_pos = 0;
-            byte_pos++;
-        }
+Deflate::BitReader::BitReader(const std::vector<Span>& input, size_t bitOffset)
+    : BitReader(input) {
+    size_t byteOffset = bitOffset / 8;
+    while (nextSpan != lastSpan && inputOffset + nextSpan->size <= byteOffset) {
+        inputOffset += nextSpan->size;
+        nextSpan++;
     }
-    return result;
+    if (nextSpan != lastSpan) {
+        size_t skip = byteOffset - inputOffset;
+        nextInput();
+        pos += skip;
+    }
+    refill();
+    consumeBits(static_cast<int>(bitOffset % 8));
 }
 
-uint32_t Deflate::BitReader::readBitsReverse(int count) {
-    uint32_t result = 0;
-    for (int i = count - 1; i >= 0; i--) {
-        if (byte_pos >= data.size()) {
-            throw std::runtime_error("Unexpected end of data");
+bool Deflate::BitReader::nextInput() {
+    while (nextSpan != lastSpan) {
+        const Span& span = *nextSpan++;
+        inputOffset += span.size;
+        if (span.size > 0) {
+            pos = span.data;
+            end = span.data + span.size;
+            return true;
         }
-        result |= ((data[byte_pos] >> bit_pos) & 1) << i;
-        bit_pos++;
-        if (bit_pos == 8) {
-            bit_pos = 0;
-            byte_pos++;
+    }
+    return false;
+}
+
+void Deflate::BitReader::refillSlow() {
+    // Near the end of a span, feed bytes one at a time, moving on to the next
+    // span as needed, and pad with zeros at the end of the input. Padding is
+    // fine as long as nobody consumes it; checkOverrun() catches streams that
+    // really are truncated.
+    checkOverrun();
+    // Stop short of 64 bits: refill() shifts the next word in by bitCount
+    while (bitCount < 56) {
+        uint64_t byte = 0;
+        if (pos < end || nextInput()) {
+            byte = *pos++;
+        } else {
+            overrun++;
         }
+        bitBuffer |= byte << bitCount;
+        bitCount += 8;
     }
+}
+
+void Deflate::BitReader::checkOverrun() const {
+    if (overrun * 8 > static_cast<size_t>(bitCount)) {
+        throw std::runtime_error("Unexpected end of data");
+    }
+}
+
+uint32_t Deflate::BitReader::readBits(int count) {
+    if (bitCount < count) refill();
+    uint32_t result = static_cast<uint32_t>(peekBits(count));
+    consumeBits(count);
     return result;
 }
 
 void Deflate::BitReader::alignToByte() {
-    if (bit_pos != 0) {
-        bit_pos = 0;
-        byte_pos++;
+    consumeBits(bitCount & 7);
+}
+
+void Deflate::BitReader::readBytes(uint8_t* dst, size_t count) {
+    // Drain whole bytes still sitting in the bit buffer, then copy the rest
+    // straight from the input
+    while (count > 0 && bitCount >= 8) {
+        *dst++ = static_cast<uint8_t>(bitBuffer);
+        consumeBits(8);
+        count--;
+    }
+    checkOverrun();
+    if (count > 0) {
+        // The buffer is empty but may still hold bits of a refill past the
+        // counted ones; those bytes are skipped now, so clear them
+        bitBuffer = 0;
+    }
+    while (count > 0) {
+        if (pos == end && !nextInput()) {
+            throw std::runtime_error("Unexpected end of data");
+        }
+        size_t n = std::min(count, static_cast<size_t>(end - pos));
+        std::memcpy(dst, pos, n);
+        dst += n;
+        pos += n;
+        count -= n;
     }
 }
 
-bool Deflate::BitReader::hasData() const {
-    return byte_pos < data.size();
+static const uint16_t lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const uint8_t distExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static uint32_t reverseBits(uint32_t code, int length) {
+    uint32_t result = 0;
+    for (int i = 0; i < length; i++) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
 }
 
-void Deflate::HuffmanTree::build(const std::vector<int>& codeLengths) {
-    maxBits = 0;
+void Deflate::HuffmanTree::build(const std::vector<int>& codeLengths, TreeKind kind) {
+    const int maxBits = 15;
+    const uint32_t primarySize = 1u << kPrimaryBits;
+    const uint32_t primaryMask = primarySize - 1;
+    
+    int blCount[maxBits + 1] = {0};
     for (int len : codeLengths) {
-        if (len > maxBits) maxBits = len;
+        if (len < 0 || len > maxBits) {
+            throw std::runtime_error("Invalid Huffman code lengths");
+        }
+        blCount[len]++;
     }
+    blCount[0] = 0;
     
-    if (maxBits == 0) return;
-    
-    std::vector<int> blCount(maxBits + 1, 0);
-    for (int len : codeLengths) {
-        if (len > 0) blCount[len]++;
+    // Over-subscribed codes are malformed; incomplete ones are legal and
+    // simply leave some table entries invalid.
+    int left = 1;
+    int used = 0;
+    for (int bits = 1; bits <= maxBits; bits++) {
+        left = (left << 1) - blCount[bits];
+        used += blCount[bits];
+        if (left < 0) {
+            throw std::runtime_error("Invalid Huffman code lengths");
+        }
     }
+    complete = left == 0 || used <= 1;
     
-    std::vector<int> nextCode(maxBits + 1, 0);
+    int nextCode[maxBits + 1] = {0};
     int code = 0;
     for (int bits = 1; bits <= maxBits; bits++) {
         code = (code + blCount[bits - 1]) << 1;
         nextCode[bits] = code;
     }
     
-    codes.resize(codeLengths.size(), -1);
-    lengths = codeLengths;
-    
+    // Deflate sends codes MSB first, so index the table by the reversed code
+    std::vector<uint32_t> reversed(codeLengths.size(), 0);
     for (size_t n = 0; n < codeLengths.size(); n++) {
         int len = codeLengths[n];
         if (len != 0) {
-            codes[n] = nextCode[len]++;
+            reversed[n] = reverseBits(nextCode[len]++, len);
         }
     }
-}
-
-int Deflate::HuffmanTree::decode(BitReader& reader) const {
-    int code = 0;
-    int first = 0;
-    int index = 0;
-    
-    for (int len = 1; len <= maxBits; len++) {
-        code |= reader.readBits(1);
-        int count = 0;
-        for (size_t i = 0; i < lengths.size(); i++) {
-            if (lengths[i] == len) count++;
-        }
-        if (code - first < count) {
-            int j = 0;
-            for (size_t i = 0; i < lengths.size(); i++) {
-                if (lengths[i] == len) {
-                    if (j == code - first) return static_cast<int>(i);
-                    j++;
-                }
+    
+    const HuffmanEntry invalid = {0, 0, kInvalid, 0};
+    table.assign(primarySize, invalid);
+    
+    // Codes longer than the primary index share a subtable per primary slot,
+    // sized for the longest code in it.
+    std::vector<uint8_t> subBits(primarySize, 0);
+    for (size_t n = 0; n < codeLengths.size(); n++) {
+        int len = codeLengths[n];
+        if (len > kPrimaryBits) {
+            uint8_t& bits = subBits[reversed[n] & primaryMask];
+            bits = std::max<uint8_t>(bits, static_cast<uint8_t>(len - kPrimaryBits));
+        }
+    }
+    for (uint32_t i = 0; i < primarySize; i++) {
+        if (subBits[i] != 0) {
+            table[i] = {static_cast<uint16_t>(table.size()), subBits[i], kSubtable, 0};
+            table.resize(table.size() + (size_t(1) << subBits[i]), invalid);
+        }
+    }
+    
+    for (size_t n = 0; n < codeLengths.size(); n++) {
+        int len = codeLengths[n];
+        if (len == 0) continue;
+        
+        HuffmanEntry entry = {static_cast<uint16_t>(n), static_cast<uint8_t>(len), kSymbol, 0};
+        if (kind == TreeKind::LiteralLength && n == 256) {
+            entry.kind = kEndOfBlock;
+        } else if (kind == TreeKind::LiteralLength && n > 256) {
+            if (n - 257 < 29) {
+                entry = {lengthBase[n - 257], entry.bits, kBase, lengthExtra[n - 257]};
+            } else {
+                entry.kind = kInvalid;
+            }
+        } else if (kind == TreeKind::Distance) {
+            if (n < 30) {
+                entry = {distBase[n], entry.bits, kBase, distExtra[n]};
+            } else {
+                entry.kind = kInvalid;
+            }
+        }
+        
+        if (len <= kPrimaryBits) {
+            for (uint32_t i = reversed[n]; i < primarySize; i += 1u << len) {
+                table[i] = entry;
+            }
+        } else {
+            const HuffmanEntry& link = table[reversed[n] & primaryMask];
+            uint32_t subSize = 1u << link.bits;
+            for (uint32_t i = reversed[n] >> kPrimaryBits; i < subSize; i += 1u << (len - kPrimaryBits)) {
+                table[link.value + i] = entry;
             }
         }
-        first = (first + count) << 1;
-        code <<= 1;
     }
-    throw std::runtime_error("Invalid Huffman code");
 }
 
-void Deflate::buildFixedTrees(HuffmanTree& litLen, HuffmanTree& dist) {
-    std::vector<int> litLenLengths(288);
-    for (int i = 0; i <= 143; i++) litLenLengths[i] = 8;
-    for (int i = 144; i <= 255; i++) litLenLengths[i] = 9;
-    for (int i = 256; i <= 279; i++) litLenLengths[i] = 7;
-    for (int i = 280; i <= 287; i++) litLenLengths[i] = 8;
-    litLen.build(litLenLengths);
+const Deflate::HuffmanEntry& Deflate::HuffmanTree::decode(BitReader& reader) const {
+    // The caller has refilled the reader; any code fits in 56 bits
+    const HuffmanEntry* entry = &table[reader.peekBits(kPrimaryBits)];
+    if (entry->kind == kSubtable) {
+        size_t index = reader.peekBits(kPrimaryBits + entry->bits) >> kPrimaryBits;
+        entry = &table[entry->value + index];
+    }
+    if (entry->kind == kInvalid) {
+        throw std::runtime_error("Invalid Huffman code");
+    }
+    reader.consumeBits(entry->bits);
+    return *entry;
+}
+
+const Deflate::HuffmanTree& Deflate::fixedLitLenTree() {
+    static const HuffmanTree tree = [] {
+        std::vector<int> litLenLengths(288);
+        for (int i = 0; i <= 143; i++) litLenLengths[i] = 8;
+        for (int i = 144; i <= 255; i++) litLenLengths[i] = 9;
+        for (int i = 256; i <= 279; i++) litLenLengths[i] = 7;
+        for (int i = 280; i <= 287; i++) litLenLengths[i] = 8;
+        HuffmanTree t;
+        t.build(litLenLengths, TreeKind::LiteralLength);
+        return t;
+    }();
+    return tree;
+}
+
+const Deflate::HuffmanTree& Deflate::fixedDistTree() {
+    static const HuffmanTree tree = [] {
+        HuffmanTree t;
+        t.build(std::vector<int>(32, 5), TreeKind::Distance);
+        return t;
+    }();
+    return tree;
+}
+
+// Bytes a fast match copy may write past the end of the match
+static const size_t copySlack = 32;
+
+void Deflate::copyMatch(uint8_t* dst, size_t distance, size_t length) {
+    // Requires copySlack writable bytes after dst + length
+    const uint8_t* src = dst - distance;
+    uint8_t* end = dst + length;
     
-    std::vector<int> distLengths(32, 5);
-    dist.build(distLengths);
+    if (distance == 1) {
+        // Run of a single byte
+        std::memset(dst, *src, length);
+    } else if (distance < 16) {
+        // Short period, e.g. distance == bytes per pixel. Expand the period
+        // into a 16-byte pattern and store it at a stride that is a multiple
+        // of the distance, so every store continues the pattern.
+        uint8_t pattern[16];
+        for (size_t i = 0; i < 16; i++) {
+            pattern[i] = src[i % distance];
+        }
+        size_t stride = 16 - 16 % distance;
+        do {
+            std::memcpy(dst, pattern, 16);
+            dst += stride;
+        } while (dst < end);
+    } else if (distance < 32) {
+        do {
+            std::memcpy(dst, src, 16);
+            dst += 16;
+            src += 16;
+        } while (dst < end);
+    } else {
+        do {
+            std::memcpy(dst, src, 32);
+            dst += 32;
+            src += 32;
+        } while (dst < end);
+    }
 }
 
-void Deflate::decodeBlock(BitReader& reader, HuffmanTree& litLen, HuffmanTree& dist,
-                          std::vector<uint8_t>& output) {
-    static const int lengthBase[] = {
-        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
-        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
-    };
-    static const int lengthExtra[] = {
-        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
-        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-    };
-    static const int distBase[] = {
-        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
-        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
-        8193, 12289, 16385, 24577
-    };
-    static const int distExtra[] = {
-        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
-        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
-    };
+void Deflate::copyMatch(uint16_t* dst, size_t distance, size_t length) {
+    const uint16_t* src = dst - distance;
+    if (distance >= length) {
+        std::memcpy(dst, src, length * sizeof(uint16_t));
+    } else {
+        for (size_t i = 0; i < length; i++) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+template <typename T>
+bool Deflate::decodeBlock(BitReader& reader, const HuffmanTree& litLen, const HuffmanTree& dist,
+                          T* output, size_t& outputPos, size_t outputSize, bool resumable) {
+    // Returns true at the end of the block. A resumable decode instead
+    // returns false before any symbol that might not fit, so the caller can
+    // make room and call again; otherwise running out of room is an error.
+    size_t pos = outputPos;
+    bool endOfBlock = false;
     
-    while (true) {
-        int symbol = litLen.decode(reader);
+    while (!resumable || outputSize - pos >= kMaxMatch) {
+        // One refill covers the longest length code, length extra bits,
+        // distance code and distance extra bits (15 + 5 + 15 + 13 bits)
+        reader.refill();
+        const HuffmanEntry& symbol = litLen.decode(reader);
         
-        if (symbol < 256) {
-            output.push_back(static_cast<uint8_t>(symbol));
-        } else if (symbol == 256) {
+        if (symbol.kind == kSymbol) {
+            if (pos == outputSize) {
+                throw std::runtime_error("Decompressed data too large");
+            }
+            output[pos++] = static_cast<T>(symbol.value);
+        } else if (symbol.kind == kEndOfBlock) {
+            endOfBlock = true;
             break;
         } else {
-            symbol -= 257;
-            int length = lengthBase[symbol] + reader.readBits(lengthExtra[symbol]);
+            size_t length = symbol.value + reader.peekBits(symbol.extra);
+            reader.consumeBits(symbol.extra);
+            
+            const HuffmanEntry& distSymbol = dist.decode(reader);
+            size_t distance = distSymbol.value + reader.peekBits(distSymbol.extra);
+            reader.consumeBits(distSymbol.extra);
             
-            int distSymbol = dist.decode(reader);
-            int distance = distBase[distSymbol] + reader.readBits(distExtra[distSymbol]);
+            if (distance > pos) {
+                throw std::runtime_error("Invalid back-reference distance");
+            }
+            if (length > outputSize - pos) {
+                throw std::runtime_error("Decompressed data too large");
+            }
             
-            size_t start = output.size() - distance;
-            for (int i = 0; i < length; i++) {
-                output.push_back(output[start + i]);
+            if (outputSize - pos >= length + copySlack) {
+                copyMatch(output + pos, distance, length);
+            } else {
+                // Too close to the end of the buffer for wide stores
+                for (size_t i = 0; i < length; i++) {
+                    output[pos + i] = output[pos + i - distance];
+                }
             }
+            pos += length;
         }
     }
+    
+    outputPos = pos;
+    return endOfBlock;
 }
 
-std::vector<uint8_t> Deflate::decompress(const std::vector<uint8_t>& data) {
-    if (data.size() < 2) {
-        throw std::runtime_error("Data too short for zlib header");
+template bool Deflate::decodeBlock<uint16_t>(BitReader&, const HuffmanTree&, const HuffmanTree&,
+                                             uint16_t*, size_t&, size_t, bool);
+
+void Deflate::readDynamicTrees(BitReader& reader, HuffmanTree& litLen, HuffmanTree& dist) {
+    int hlit = reader.readBits(5) + 257;
+    int hdist = reader.readBits(5) + 1;
+    int hclen = reader.readBits(4) + 4;
+    
+    static const int codeLengthOrder[] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    
+    std::vector<int> codeLengthLengths(19, 0);
+    for (int i = 0; i < hclen; i++) {
+        codeLengthLengths[codeLengthOrder[i]] = reader.readBits(3);
+    }
+    
+    HuffmanTree codeLengthTree;
+    codeLengthTree.build(codeLengthLengths, TreeKind::CodeLength);
+    
+    std::vector<int> allLengths;
+    while (allLengths.size() < static_cast<size_t>(hlit + hdist)) {
+        reader.refill();
+        int symbol = codeLengthTree.decode(reader).value;
+        
+        if (symbol < 16) {
+            allLengths.push_back(symbol);
+        } else if (symbol == 16) {
+            if (allLengths.empty()) {
+                throw std::runtime_error("Invalid code length repeat");
+            }
+            int repeat = reader.readBits(2) + 3;
+            int value = allLengths.back();
+            for (int i = 0; i < repeat; i++) {
+                allLengths.push_back(value);
+            }
+        } else if (symbol == 17) {
+            int repeat = reader.readBits(3) + 3;
+            for (int i = 0; i < repeat; i++) {
+                allLengths.push_back(0);
+            }
+        } else if (symbol == 18) {
+            int repeat = reader.readBits(7) + 11;
+            for (int i = 0; i < repeat; i++) {
+                allLengths.push_back(0);
+            }
+        }
+    }
+    
+    if (allLengths.size() != static_cast<size_t>(hlit + hdist)) {
+        throw std::runtime_error("Invalid code length repeat");
     }
+    if (allLengths[256] == 0) {
+        throw std::runtime_error("Missing end-of-block code");
+    }
+    
+    std::vector<int> litLenLengths(allLengths.begin(), allLengths.begin() + hlit);
+    std::vector<int> distLengths(allLengths.begin() + hlit, allLengths.end());
     
-    // Skip zlib header (2 bytes)
-    std::vector<uint8_t> deflateData(data.begin() + 2, data.end() - 4); // Also skip adler32
+    litLen.build(litLenLengths, TreeKind::LiteralLength);
+    dist.build(distLengths, TreeKind::Distance);
+}
+
+void Deflate::inflate(const std::vector<Span>& input, uint8_t* output, size_t outputSize) {
+    BitReader reader(input);
+    size_t outputPos = 0;
     
-    BitReader reader(deflateData);
-    std::vector<uint8_t> output;
+    // zlib header: deflate method, no preset dictionary. The adler32 trailer
+    // after the final block is left unread.
+    uint32_t cmf = reader.readBits(8);
+    uint32_t flg = reader.readBits(8);
+    if ((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) != 0) {
+        throw std::runtime_error("Invalid zlib header");
+    }
     
     bool finalBlock = false;
     while (!finalBlock) {
@@ -175,75 +443,138 @@ std::vector<uint8_t> Deflate::decompress(const std::vector<uint8_t>& data) {
         if (blockType == 0) {
             // Stored block
             reader.alignToByte();
-            if (reader.byte_pos + 4 > deflateData.size()) {
+            uint32_t len = reader.readBits(16);
+            uint32_t nlen = reader.readBits(16);
+            if ((len ^ 0xFFFF) != nlen) {
                 throw std::runtime_error("Invalid stored block");
             }
-            uint16_t len = deflateData[reader.byte_pos] | (deflateData[reader.byte_pos + 1] << 8);
-            reader.byte_pos += 4; // Skip len and nlen
-            
-            for (int i = 0; i < len; i++) {
-                output.push_back(deflateData[reader.byte_pos++]);
+            if (len > outputSize - outputPos) {
+                throw std::runtime_error("Decompressed data too large");
             }
+            
+            reader.readBytes(output + outputPos, len);
+            outputPos += len;
         } else if (blockType == 1) {
             // Fixed Huffman
-            HuffmanTree litLen, dist;
-            buildFixedTrees(litLen, dist);
-            decodeBlock(reader, litLen, dist, output);
+            decodeBlock(reader, fixedLitLenTree(), fixedDistTree(), output, outputPos, outputSize, false);
         } else if (blockType == 2) {
             // Dynamic Huffman
-            int hlit = reader.readBits(5) + 257;
-            int hdist = reader.readBits(5) + 1;
-            int hclen = reader.readBits(4) + 4;
-            
-            static const int codeLengthOrder[] = {
-                16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
-            };
-            
-            std::vector<int> codeLengthLengths(19, 0);
-            for (int i = 0; i < hclen; i++) {
-                codeLengthLengths[codeLengthOrder[i]] = reader.readBits(3);
-            }
-            
-            HuffmanTree codeLengthTree;
-            codeLengthTree.build(codeLengthLengths);
-            
-            std::vector<int> allLengths;
-            while (allLengths.size() < static_cast<size_t>(hlit + hdist)) {
-                int symbol = codeLengthTree.decode(reader);
-                
-                if (symbol < 16) {
-                    allLengths.push_back(symbol);
-                } else if (symbol == 16) {
-                    int repeat = reader.readBits(2) + 3;
-                    int value = allLengths.back();
-                    for (int i = 0; i < repeat; i++) {
-                        allLengths.push_back(value);
-                    }
-                } else if (symbol == 17) {
-                    int repeat = reader.readBits(3) + 3;
-                    for (int i = 0; i < repeat; i++) {
-                        allLengths.push_back(0);
-                    }
-                } else if (symbol == 18) {
-                    int repeat = reader.readBits(7) + 11;
-                    for (int i = 0; i < repeat; i++) {
-                        allLengths.push_back(0);
-                    }
-                }
-            }
-            
-            std::vector<int> litLenLengths(allLengths.begin(), allLengths.begin() + hlit);
-            std::vector<int> distLengths(allLengths.begin() + hlit, allLengths.end());
-            
             HuffmanTree litLen, dist;
-            litLen.build(litLenLengths);
-            dist.build(distLengths);
-            
-            decodeBlock(reader, litLen, dist, output);
+            readDynamicTrees(reader, litLen, dist);
+            decodeBlock(reader, litLen, dist, output, outputPos, outputSize, false);
         } else {
             throw std::runtime_error("Invalid block type");
         }
     }
     
-    return output;
-}
\ No newline at end of file
+    reader.checkOverrun();
+    if (outputPos != outputSize) {
+        throw std::runtime_error("Decompressed data too short");
+    }
+}
+Deflate::Stream::Stream(const std::vector<Span>& input)
+    : reader_(input), state_(State::BlockHeader), finalBlock_(false), storedLeft_(0),
+      blockLitLen_(nullptr), blockDist_(nullptr), buffer_(kBufferSize), filled_(0), consumed_(0) {
+    // zlib header: deflate method, no preset dictionary
+    uint32_t cmf = reader_.readBits(8);
+    uint32_t flg = reader_.readBits(8);
+    if ((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) != 0) {
+        throw std::runtime_error("Invalid zlib header");
+    }
+}
+
+void Deflate::Stream::read(uint8_t* dst, size_t count) {
+    while (count > 0) {
+        if (consumed_ == filled_) {
+            fill();
+        }
+        size_t n = std::min(count, filled_ - consumed_);
+        std::memcpy(dst, buffer_.data() + consumed_, n);
+        dst += n;
+        consumed_ += n;
+        count -= n;
+    }
+}
+
+void Deflate::Stream::finish() {
+    // Whatever is left of the final block has to decode to nothing; the
+    // adler32 trailer is left unread, as in inflate()
+    if (consumed_ != filled_) {
+        throw std::runtime_error("Decompressed data too large");
+    }
+    makeRoom();
+    while (!finalBlock_ || state_ != State::BlockHeader) {
+        decodeStep();
+        if (filled_ != consumed_) {
+            throw std::runtime_error("Decompressed data too large");
+        }
+    }
+    reader_.checkOverrun();
+}
+
+void Deflate::Stream::fill() {
+    // Only called once everything decoded has been read
+    makeRoom();
+    while (consumed_ == filled_) {
+        if (finalBlock_ && state_ == State::BlockHeader) {
+            throw std::runtime_error("Decompressed data too short");
+        }
+        decodeStep();
+    }
+    // Bytes decoded from the zero padding past the input must not get out
+    reader_.checkOverrun();
+}
+
+void Deflate::Stream::makeRoom() {
+    // Slide the last window's worth of output to the front once the rest of
+    // the buffer no longer has room for a match
+    if (buffer_.size() - filled_ < 2 * kMaxMatch && filled_ > kWindowSize) {
+        std::memmove(buffer_.data(), buffer_.data() + filled_ - kWindowSize, kWindowSize);
+        consumed_ -= filled_ - kWindowSize;
+        filled_ = kWindowSize;
+    }
+}
+
+void Deflate::Stream::decodeStep() {
+    // Reads a block header, or decodes as much of the current block as fits
+    if (state_ == State::BlockHeader) {
+        finalBlock_ = reader_.readBits(1) != 0;
+        int blockType = reader_.readBits(2);
+        
+        if (blockType == 0) {
+            // Stored block
+            reader_.alignToByte();
+            uint32_t len = reader_.readBits(16);
+            uint32_t nlen = reader_.readBits(16);
+            if ((len ^ 0xFFFF) != nlen) {
+                throw std::runtime_error("Invalid stored block");
+            }
+            storedLeft_ = len;
+            state_ = State::Stored;
+        } else if (blockType == 1) {
+            // Fixed Huffman
+            blockLitLen_ = &fixedLitLenTree();
+            blockDist_ = &fixedDistTree();
+            state_ = State::Compressed;
+        } else if (blockType == 2) {
+            // Dynamic Huffman
+            readDynamicTrees(reader_, litLen_, dist_);
+            blockLitLen_ = &litLen_;
+            blockDist_ = &dist_;
+            state_ = State::Compressed;
+        } else {
+            throw std::runtime_error("Invalid block type");
+        }
+    } else if (state_ == State::Stored) {
+        size_t n = std::min(storedLeft_, buffer_.size() - filled_);
+        reader_.readBytes(buffer_.data() + filled_, n);
+        filled_ += n;
+        storedLeft_ -= n;
+        if (storedLeft_ == 0) {
+            state_ = State::BlockHeader;
+        }
+    } else if (decodeBlock(reader_, *blockLitLen_, *blockDist_, buffer_.data(), filled_,
+                           buffer_.size(), true)) {
+        state_ = State::BlockHeader;
+    }
+}
@@ -0,0 +1,349 @@
+#include "deflate.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+// Speculative parallel inflate, after rapidgzip/pugz.
+//
+// The compressed stream is cut at fixed byte boundaries. Each chunk after
+// the first searches forward from its boundary for something that parses as
+// a dynamic-Huffman block header and decodes from there into 16-bit
+// symbols. The 32 KiB window in front of a chunk is unknown at that point,
+// so the symbol buffer starts with one marker per window byte; matches that
+// reach back into the window copy markers instead of bytes. Every chunk
+// decodes up to the first dynamic block that starts at or after the next
+// boundary, which is exactly where the next chunk's search should have
+// landed. Stitching walks the chunks in order and accepts a speculative
+// result only if it starts where its predecessor stopped; any other chunk
+// is decoded again from the real boundary. Once the chunk offsets are known
+// the markers are replaced by window bytes: the last 32 KiB of each chunk in
+// order (each one is the window of the next), the rest in parallel.
+
+// Size of the LZ77 window, and the number of markers in front of each chunk
+static const size_t windowSize = 32768;
+static const uint16_t firstMarker = 256;
+
+// Compressed bytes per chunk, and the smallest stream worth splitting
+static const size_t minChunkBytes = size_t(1) << 18;
+static const size_t maxChunkBytes = size_t(1) << 22;
+
+struct Deflate::Chunk {
+    size_t startBit = 0;
+    size_t endBit = 0;        // where decoding stopped
+    bool finalBlock = false;  // decoded through the end of the stream
+    bool valid = false;
+    size_t outputOffset = 0;
+    std::vector<uint16_t> symbols; // windowSize markers, then decoded symbols
+};
+
+template <typename Worker>
+static void runParallel(size_t count, unsigned threads, Worker worker) {
+    // Runs worker(0..count-1) on up to `threads` threads; the first exception
+    // thrown by any worker is rethrown once all threads have finished
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto loop = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                worker(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+                next = count;
+            }
+        }
+    };
+    
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < std::min<size_t>(threads, count); t++) {
+        pool.emplace_back(loop);
+    }
+    loop();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Deflate::decodeChunk(const std::vector<Span>& input, size_t startBit, size_t stopBit,
+                          size_t maxOutput, Chunk& chunk) {
+    // Decodes blocks from startBit until a dynamic block starts at or after
+    // stopBit, or through the final block
+    BitReader reader(input, startBit);
+    std::vector<uint16_t>& symbols = chunk.symbols;
+    const size_t maxSize = windowSize + maxOutput;
+    
+    symbols.resize(windowSize + kMaxMatch * 64);
+    for (size_t i = 0; i < windowSize; i++) {
+        symbols[i] = static_cast<uint16_t>(firstMarker + i);
+    }
+    size_t pos = windowSize;
+    
+    auto grow = [&](size_t needed) {
+        if (needed > maxSize + kMaxMatch) {
+            throw std::runtime_error("Decompressed data too large");
+        }
+        symbols.resize(std::min(std::max(needed, symbols.size() * 2), maxSize + kMaxMatch));
+    };
+    
+    chunk.startBit = startBit;
+    chunk.finalBlock = false;
+    while (true) {
+        size_t blockStart = reader.bitPosition();
+        reader.refill();
+        if (blockStart >= stopBit && reader.peekBits(3) == 4) {
+            // Non-final dynamic block: where the next chunk's search lands
+            chunk.endBit = blockStart;
+            break;
+        }
+        
+        bool finalBlock = reader.readBits(1) != 0;
+        int blockType = reader.readBits(2);
+        
+        if (blockType == 0) {
+            reader.alignToByte();
+            uint32_t len = reader.readBits(16);
+            uint32_t nlen = reader.readBits(16);
+            if ((len ^ 0xFFFF) != nlen) {
+                throw std::runtime_error("Invalid stored block");
+            }
+            if (symbols.size() - pos < len) {
+                grow(pos + len);
+            }
+            
+            std::vector<uint8_t> bytes(len);
+            reader.readBytes(bytes.data(), len);
+            std::copy(bytes.begin(), bytes.end(), symbols.begin() + pos);
+            pos += len;
+        } else if (blockType == 1 || blockType == 2) {
+            HuffmanTree dynamicLitLen, dynamicDist;
+            if (blockType == 2) {
+                readDynamicTrees(reader, dynamicLitLen, dynamicDist);
+            }
+            const HuffmanTree& litLen = blockType == 1 ? fixedLitLenTree() : dynamicLitLen;
+            const HuffmanTree& dist = blockType == 1 ? fixedDistTree() : dynamicDist;
+            
+            while (!decodeBlock(reader, litLen, dist, symbols.data(), pos, symbols.size(), true)) {
+                grow(symbols.size() + 1);
+            }
+        } else {
+            throw std::runtime_error("Invalid block type");
+        }
+        
+        if (pos > maxSize) {
+            throw std::runtime_error("Decompressed data too large");
+        }
+        if (finalBlock) {
+            reader.checkOverrun();
+            chunk.endBit = reader.bitPosition();
+            chunk.finalBlock = true;
+            break;
+        }
+    }
+    
+    symbols.resize(pos);
+    chunk.valid = true;
+}
+
+bool Deflate::isDynamicBlockStart(const uint8_t* data, size_t bit) {
+    // Cheap filter on the fixed-size part of a non-final dynamic block
+    // header: BFINAL = 0, BTYPE = 2, HLIT <= 29, HDIST <= 29, and a complete
+    // code-length code. Nearly all bit offsets fail here.
+    uint64_t header = loadLE64(data + bit / 8) >> (bit % 8);
+    if ((header & 7) != 4) return false;
+    if (((header >> 3) & 31) > 29 || ((header >> 8) & 31) > 29) return false;
+    
+    int hclen = static_cast<int>((header >> 13) & 15) + 4;
+    uint64_t lengths = loadLE64(data + (bit + 17) / 8) >> ((bit + 17) % 8);
+    int kraft = 0;
+    for (int i = 0; i < hclen; i++) {
+        int len = static_cast<int>((lengths >> (3 * i)) & 7);
+        if (len != 0) kraft += 128 >> len;
+    }
+    return kraft == 128;
+}
+
+void Deflate::speculateChunk(const std::vector<Span>& input, size_t fromBit, size_t toBit,
+                             size_t stopBit, size_t maxOutput, Chunk& chunk) {
+    // Copy the search range (plus room for the longest block header) so
+    // candidate offsets can be tested without walking spans
+    size_t firstByte = fromBit / 8;
+    size_t lastByte = toBit / 8 + 1024;
+    std::vector<uint8_t> region(lastByte - firstByte + 8, 0);
+    size_t offset = 0;
+    for (const Span& span : input) {
+        size_t begin = std::max(offset, firstByte);
+        size_t end = std::min(offset + span.size, lastByte);
+        if (begin < end) {
+            std::copy(span.data + (begin - offset), span.data + (end - offset),
+                      region.begin() + (begin - firstByte));
+        }
+        offset += span.size;
+    }
+    std::vector<Span> regionSpan = {{region.data(), region.size()}};
+    
+    for (size_t bit = fromBit; bit < toBit; bit++) {
+        size_t regionBit = bit - firstByte * 8;
+        if (!isDynamicBlockStart(region.data(), regionBit)) {
+            continue;
+        }
+        
+        try {
+            // The whole header must parse into complete codes before the
+            // (much more expensive) speculative decode is attempted
+            BitReader reader(regionSpan, regionBit + 3);
+            HuffmanTree litLen, dist;
+            readDynamicTrees(reader, litLen, dist);
+            if (!litLen.complete || !dist.complete) {
+                continue;
+            }
+            decodeChunk(input, bit, stopBit, maxOutput, chunk);
+            return;
+        } catch (const std::exception&) {
+            // Not a block boundary after all; keep searching
+        }
+    }
+    chunk.valid = false;
+    chunk.symbols = std::vector<uint16_t>();
+}
+
+void Deflate::resolveChunk(const Chunk& chunk, size_t from, size_t to, uint8_t* output) {
+    // Symbol i of the chunk lands at output[outputOffset + i - windowSize];
+    // marker w stands for the byte at output[outputOffset + w - windowSize]
+    const uint16_t* symbols = chunk.symbols.data();
+    uint8_t* dst = output + chunk.outputOffset;
+    const size_t firstValid = chunk.outputOffset >= windowSize ? 0 : windowSize - chunk.outputOffset;
+    
+    for (size_t i = from; i < to; i++) {
+        uint16_t symbol = symbols[i];
+        if (symbol < firstMarker) {
+            dst[i - windowSize] = static_cast<uint8_t>(symbol);
+        } else {
+            size_t w = symbol - firstMarker;
+            if (w < firstValid) {
+                throw std::runtime_error("Invalid back-reference distance");
+            }
+            dst[i - windowSize] = output[chunk.outputOffset + w - windowSize];
+        }
+    }
+}
+
+void Deflate::inflateParallel(const std::vector<Span>& input, uint8_t* output,
+                              size_t outputSize, unsigned threads) {
+    size_t inputSize = 0;
+    for (const Span& span : input) {
+        inputSize += span.size;
+    }
+    
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t chunkBytes = std::min(maxChunkBytes, std::max(minChunkBytes, inputSize / (threads * 4)));
+    if (threads < 2 || inputSize < 2 * chunkBytes) {
+        inflate(input, output, outputSize);
+        return;
+    }
+    inflateChunked(input, output, outputSize, threads, chunkBytes);
+}
+
+Deflate::ChunkStats Deflate::inflateChunked(const std::vector<Span>& input, uint8_t* output,
+                                            size_t outputSize, unsigned threads,
+                                            size_t chunkBytes) {
+    size_t inputSize = 0;
+    for (const Span& span : input) {
+        inputSize += span.size;
+    }
+    ChunkStats stats;
+    
+    // zlib header: deflate method, no preset dictionary
+    BitReader header(input);
+    uint32_t cmf = header.readBits(8);
+    uint32_t flg = header.readBits(8);
+    if ((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) != 0) {
+        throw std::runtime_error("Invalid zlib header");
+    }
+    
+    // Chunk k covers bits [boundary(k), boundary(k + 1))
+    const size_t chunkCount = (inputSize + chunkBytes - 1) / chunkBytes;
+    auto boundary = [&](size_t k) -> size_t {
+        if (k == 0) return 16;
+        if (k >= chunkCount) return SIZE_MAX;
+        return k * chunkBytes * 8;
+    };
+    
+    std::vector<Chunk> chunks(chunkCount);
+    runParallel(chunkCount, threads, [&](size_t k) {
+        if (k == 0) {
+            // Chunk 0 starts at a known boundary; errors are real errors and
+            // surface when it is decoded again during stitching
+            try {
+                decodeChunk(input, boundary(0), boundary(1), outputSize, chunks[0]);
+            } catch (const std::exception&) {
+                chunks[0].valid = false;
+            }
+        } else {
+            speculateChunk(input, boundary(k), std::min(boundary(k + 1), inputSize * 8),
+                           boundary(k + 1), outputSize, chunks[k]);
+        }
+    });
+    
+    // Keep the chunks that form the real decode, in order
+    std::vector<Chunk*> accepted;
+    size_t expectedBit = boundary(0);
+    size_t outputOffset = 0;
+    for (size_t k = 0; k < chunkCount; k++) {
+        if (boundary(k + 1) <= expectedBit) {
+            // Entirely covered by an earlier chunk's last block
+            chunks[k].symbols = std::vector<uint16_t>();
+            continue;
+        }
+        
+        Chunk& chunk = chunks[k];
+        if (!chunk.valid || chunk.startBit != expectedBit) {
+            // Misprediction: decode serially from the real boundary
+            decodeChunk(input, expectedBit, boundary(k + 1), outputSize, chunk);
+            stats.redecoded++;
+        }
+        
+        chunk.outputOffset = outputOffset;
+        outputOffset += chunk.symbols.size() - windowSize;
+        if (outputOffset > outputSize) {
+            throw std::runtime_error("Decompressed data too large");
+        }
+        accepted.push_back(&chunk);
+        expectedBit = chunk.endBit;
+        
+        if (chunk.finalBlock) {
+            break;
+        }
+    }
+    
+    if (accepted.empty() || !accepted.back()->finalBlock) {
+        throw std::runtime_error("Unexpected end of data");
+    }
+    if (outputOffset != outputSize) {
+        throw std::runtime_error("Decompressed data too short");
+    }
+    
+    // Resolve markers: tails in order, since each tail is the next chunk's
+    // window, then everything else in parallel
+    std::vector<size_t> tailStart(accepted.size());
+    for (size_t i = 0; i < accepted.size(); i++) {
+        const Chunk& chunk = *accepted[i];
+        size_t size = chunk.symbols.size();
+        tailStart[i] = std::max(windowSize, size >= windowSize ? size - windowSize : 0);
+        resolveChunk(chunk, tailStart[i], size, output);
+    }
+    runParallel(accepted.size(), threads, [&](size_t i) {
+        resolveChunk(*accepted[i], windowSize, tailStart[i], output);
+    });
+    
+    stats.chunks = accepted.size();
+    return stats;
+}
@@ -1,25 +1,48 @@
 #include "image.hpp"
 #include <stdexcept>
 
-Image::Image(uint32_t width, uint32_t height) 
-    : width_(width), height_(height), pixels_(width * height) {}
+Image::Image(uint32_t width, uint32_t height, int channels)
+    : width_(0), height_(0), channels_(0), stride_(0) {
+    resize(width, height, channels);
+}
 
-void Image::resize(uint32_t width, uint32_t height) {
+void Image::resize(uint32_t width, uint32_t height, int channels) {
+    if (channels != 1 && channels != 3) {
+        throw std::invalid_argument("Image must have 1 or 3 channels");
+    }
+    
     width_ = width;
     height_ = height;
-    pixels_.resize(width * height);
+    channels_ = channels;
+    stride_ = (size_t(width) + kRowAlignment - 1) / kRowAlignment * kRowAlignment;
+    
+    uint64_t size = uint64_t(stride_) * height * channels;
+    if (size > SIZE_MAX) {
+        throw std::length_error("Image too large");
+    }
+    planes_.assign(static_cast<size_t>(size), 0);
 }
 
-Pixel& Image::at(uint32_t x, uint32_t y) {
+Pixel Image::at(uint32_t x, uint32_t y) const {
     if (x >= width_ || y >= height_) {
         throw std::out_of_range("Pixel coordinates out of range");
     }
-    return pixels_[y * width_ + x];
+    if (channels_ == 1) {
+        uint8_t gray = row(0, y)[x];
+        return Pixel(gray, gray, gray);
+    }
+    return Pixel(row(0, y)[x], row(1, y)[x], row(2, y)[x]);
 }
 
-const Pixel& Image::at(uint32_t x, uint32_t y) const {
+void Image::set(uint32_t x, uint32_t y, const Pixel& pixel) {
     if (x >= width_ || y >= height_) {
         throw std::out_of_range("Pixel coordinates out of range");
     }
-    return pixels_[y * width_ + x];
-}
\ No newline at end of file
+    if (channels_ == 1) {
+        row(0, y)[x] = pixel.r; // gray planes keep the first sample
+        return;
+    }
+    row(0, y)[x] = pixel.r;
+    row(1, y)[x] = pixel.g;
+    row(2, y)[x] = pixel.b;
+}
@@ -1,8 +1,16 @@
 #include "jpeg_encoder.hpp"
-#include <fstream>
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PNG2JPG_SSE2 1
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 const int JPEGEncoder::ZIGZAG[64] = {
     0,  1,  8, 16,  9,  2,  3, 10,
@@ -74,78 +82,766 @@ static const uint8_t acChrominanceValues[] = {
     0xf9, 0xfa
 };
 
-void JPEGEncoder::BitWriter::writeBits(uint16_t bits, int count) {
-    buffer = (buffer << count) | bits;
-    bitCount += count;
+void JPEGEncoder::BitWriter::start(size_t expected) {
+    pos = output.size();
+    output.resize(pos + std::max<size_t>(expected, 64));
+}
+
+void JPEGEncoder::BitWriter::flushWord() {
+    bitCount -= 32;
+    uint32_t word = static_cast<uint32_t>(buffer >> bitCount);
     
-    while (bitCount >= 8) {
-        bitCount -= 8;
-        uint8_t byte = (buffer >> bitCount) & 0xFF;
-        output.push_back(byte);
+    // Worst case is four 0xFF bytes, each followed by a stuffed zero
+    if (output.size() - pos < 8) {
+        output.resize(std::max(output.size() * 2, pos + 8));
+    }
+    uint8_t* p = output.data() + pos;
+    
+    // A byte of `word` is 0xFF exactly when the same byte of ~word is zero
+    uint32_t inverted = ~word;
+    if (((inverted - 0x01010101u) & ~inverted & 0x80808080u) == 0) {
+        p[0] = static_cast<uint8_t>(word >> 24);
+        p[1] = static_cast<uint8_t>(word >> 16);
+        p[2] = static_cast<uint8_t>(word >> 8);
+        p[3] = static_cast<uint8_t>(word);
+        pos += 4;
+        return;
+    }
+    
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        uint8_t byte = static_cast<uint8_t>(word >> shift);
+        *p++ = byte;
         if (byte == 0xFF) {
-            output.push_back(0x00); // Byte stuffing
+            *p++ = 0x00; // Byte stuffing
         }
     }
+    pos = p - output.data();
 }
 
 void JPEGEncoder::BitWriter::flush() {
-    if (bitCount > 0) {
-        buffer <<= (8 - bitCount);
-        uint8_t byte = buffer & 0xFF;
-        output.push_back(byte);
+    // Pad the last partial byte with one bits (F.1.2.3)
+    int padding = (8 - bitCount % 8) % 8;
+    buffer = (buffer << padding) | ((1u << padding) - 1);
+    bitCount += padding;
+    
+    if (output.size() - pos < 8) {
+        output.resize(pos + 8);
+    }
+    while (bitCount > 0) {
+        bitCount -= 8;
+        uint8_t byte = static_cast<uint8_t>(buffer >> bitCount);
+        output[pos++] = byte;
         if (byte == 0xFF) {
-            output.push_back(0x00);
+            output[pos++] = 0x00;
         }
     }
+    
+    // Further segments are appended after the coded data
+    output.resize(pos);
+}
+
+// Color conversion coefficients scaled by 2^16, as in IJG jccolor.c. The
+// 0.587 for green does not fit a signed 16-bit multiplier and is split into
+// 0.337 + 0.250; the 0.5 terms are done as shifts.
+static const int32_t kYR = 19595;    // 0.29900
+static const int32_t kYG1 = 22086;   // 0.33700
+static const int32_t kYG2 = 16384;   // 0.25000
+static const int32_t kYB = 7471;     // 0.11400
+static const int32_t kCbR = -11059;  // -0.16874
+static const int32_t kCbG = -21709;  // -0.33126
+static const int32_t kCrG = -27439;  // -0.41869
+static const int32_t kCrB = -5329;   // -0.08131
+
+// One pixel of rgbToYCbCr; the level shift folds into the rounding constants
+static inline int16_t rgbToYPixel(int r, int g, int b) {
+    return static_cast<int16_t>(((kYR * r + (kYG1 + kYG2) * g + kYB * b + 32768) >> 16) - 128);
 }
 
-void JPEGEncoder::rgbToYCbCr(uint8_t r, uint8_t g, uint8_t b,
-                              float& y, float& cb, float& cr) {
-    y  =  0.299f * r + 0.587f * g + 0.114f * b;
-    cb = -0.168736f * r - 0.331264f * g + 0.5f * b + 128.0f;
-    cr =  0.5f * r - 0.418688f * g - 0.081312f * b + 128.0f;
+static inline void rgbToYCbCrPixel(int r, int g, int b, int16_t& y, int16_t& cb, int16_t& cr) {
+    y = rgbToYPixel(r, g, b);
+    cb = static_cast<int16_t>((kCbR * r + kCbG * g + (b << 15) + 32767) >> 16);
+    cr = static_cast<int16_t>(((r << 15) + kCrG * g + kCrB * b + 32767) >> 16);
 }
 
-void JPEGEncoder::forwardDCT(float block[8][8]) {
-    const float c1 = 0.980785f; // cos(pi/16)
-    const float c2 = 0.923880f; // cos(2*pi/16)
-    const float c3 = 0.831470f; // cos(3*pi/16)
-    const float c4 = 0.707107f; // cos(4*pi/16) = 1/sqrt(2)
-    const float c5 = 0.555570f; // cos(5*pi/16)
-    const float c6 = 0.382683f; // cos(6*pi/16)
-    const float c7 = 0.195090f; // cos(7*pi/16)
+#ifdef PNG2JPG_SSE2
+// Eight pixels of rgbToYCbCr from 16-bit R, G, B lanes. madd_epi16 forms
+// two products per 32-bit lane; the results are packed back to 16 bits.
+static inline __m128i rgbToYVec(__m128i r, __m128i g, __m128i b) {
+    const __m128i yRG = _mm_set_epi16(kYG1, kYR, kYG1, kYR, kYG1, kYR, kYG1, kYR);
+    const __m128i yBG = _mm_set_epi16(kYG2, kYB, kYG2, kYB, kYG2, kYB, kYG2, kYB);
+    const __m128i yRound = _mm_set1_epi32(32768);
     
-    // Slow but correct DCT implementation
-    float temp[8][8];
+    __m128i yLo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), yRG),
+                                _mm_madd_epi16(_mm_unpacklo_epi16(b, g), yBG));
+    __m128i yHi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), yRG),
+                                _mm_madd_epi16(_mm_unpackhi_epi16(b, g), yBG));
+    yLo = _mm_srai_epi32(_mm_add_epi32(yLo, yRound), 16);
+    yHi = _mm_srai_epi32(_mm_add_epi32(yHi, yRound), 16);
+    return _mm_sub_epi16(_mm_packs_epi32(yLo, yHi), _mm_set1_epi16(128));
+}
+
+static inline void rgbToYCbCrVec(__m128i r, __m128i g, __m128i b,
+                                 __m128i& y, __m128i& cb, __m128i& cr) {
+    const __m128i cbRG = _mm_set_epi16(kCbG, kCbR, kCbG, kCbR, kCbG, kCbR, kCbG, kCbR);
+    const __m128i crGB = _mm_set_epi16(kCrB, kCrG, kCrB, kCrG, kCrB, kCrG, kCrB, kCrG);
+    const __m128i cRound = _mm_set1_epi32(32767);
+    const __m128i zero = _mm_setzero_si128();
     
-    for (int u = 0; u < 8; u++) {
-        for (int v = 0; v < 8; v++) {
-            float sum = 0.0f;
-            for (int x = 0; x < 8; x++) {
-                for (int y = 0; y < 8; y++) {
-                    sum += block[x][y] * 
-                           std::cos((2.0f * x + 1.0f) * u * 3.14159265f / 16.0f) *
-                           std::cos((2.0f * y + 1.0f) * v * 3.14159265f / 16.0f);
-                }
+    __m128i rgLo = _mm_unpacklo_epi16(r, g), rgHi = _mm_unpackhi_epi16(r, g);
+    __m128i gbLo = _mm_unpacklo_epi16(g, b), gbHi = _mm_unpackhi_epi16(g, b);
+    
+    y = rgbToYVec(r, g, b);
+    
+    __m128i bLo = _mm_slli_epi32(_mm_unpacklo_epi16(b, zero), 15);
+    __m128i bHi = _mm_slli_epi32(_mm_unpackhi_epi16(b, zero), 15);
+    __m128i cbLo = _mm_add_epi32(_mm_madd_epi16(rgLo, cbRG), _mm_add_epi32(bLo, cRound));
+    __m128i cbHi = _mm_add_epi32(_mm_madd_epi16(rgHi, cbRG), _mm_add_epi32(bHi, cRound));
+    cb = _mm_packs_epi32(_mm_srai_epi32(cbLo, 16), _mm_srai_epi32(cbHi, 16));
+    
+    __m128i rLo = _mm_slli_epi32(_mm_unpacklo_epi16(r, zero), 15);
+    __m128i rHi = _mm_slli_epi32(_mm_unpackhi_epi16(r, zero), 15);
+    __m128i crLo = _mm_add_epi32(_mm_madd_epi16(gbLo, crGB), _mm_add_epi32(rLo, cRound));
+    __m128i crHi = _mm_add_epi32(_mm_madd_epi16(gbHi, crGB), _mm_add_epi32(rHi, cRound));
+    cr = _mm_packs_epi32(_mm_srai_epi32(crLo, 16), _mm_srai_epi32(crHi, 16));
+}
+
+#ifdef __AVX2__
+// Same on 16 pixels. Unpack and pack both work within 128-bit lanes, so the
+// pixel order comes out as it went in.
+static inline __m256i rgbToYVec(__m256i r, __m256i g, __m256i b) {
+    const __m256i yRG = _mm256_set1_epi32(int32_t(uint32_t(kYG1) << 16 | uint16_t(kYR)));
+    const __m256i yBG = _mm256_set1_epi32(int32_t(uint32_t(kYG2) << 16 | uint16_t(kYB)));
+    const __m256i yRound = _mm256_set1_epi32(32768);
+    
+    __m256i yLo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r, g), yRG),
+                                   _mm256_madd_epi16(_mm256_unpacklo_epi16(b, g), yBG));
+    __m256i yHi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r, g), yRG),
+                                   _mm256_madd_epi16(_mm256_unpackhi_epi16(b, g), yBG));
+    yLo = _mm256_srai_epi32(_mm256_add_epi32(yLo, yRound), 16);
+    yHi = _mm256_srai_epi32(_mm256_add_epi32(yHi, yRound), 16);
+    return _mm256_sub_epi16(_mm256_packs_epi32(yLo, yHi), _mm256_set1_epi16(128));
+}
+
+static inline void rgbToYCbCrVec(__m256i r, __m256i g, __m256i b,
+                                 __m256i& y, __m256i& cb, __m256i& cr) {
+    const __m256i cbRG = _mm256_set1_epi32(int32_t(uint32_t(uint16_t(kCbG)) << 16 | uint16_t(kCbR)));
+    const __m256i crGB = _mm256_set1_epi32(int32_t(uint32_t(uint16_t(kCrB)) << 16 | uint16_t(kCrG)));
+    const __m256i cRound = _mm256_set1_epi32(32767);
+    const __m256i zero = _mm256_setzero_si256();
+    
+    __m256i rgLo = _mm256_unpacklo_epi16(r, g), rgHi = _mm256_unpackhi_epi16(r, g);
+    __m256i gbLo = _mm256_unpacklo_epi16(g, b), gbHi = _mm256_unpackhi_epi16(g, b);
+    
+    y = rgbToYVec(r, g, b);
+    
+    __m256i bLo = _mm256_slli_epi32(_mm256_unpacklo_epi16(b, zero), 15);
+    __m256i bHi = _mm256_slli_epi32(_mm256_unpackhi_epi16(b, zero), 15);
+    __m256i cbLo = _mm256_add_epi32(_mm256_madd_epi16(rgLo, cbRG), _mm256_add_epi32(bLo, cRound));
+    __m256i cbHi = _mm256_add_epi32(_mm256_madd_epi16(rgHi, cbRG), _mm256_add_epi32(bHi, cRound));
+    cb = _mm256_packs_epi32(_mm256_srai_epi32(cbLo, 16), _mm256_srai_epi32(cbHi, 16));
+    
+    __m256i rLo = _mm256_slli_epi32(_mm256_unpacklo_epi16(r, zero), 15);
+    __m256i rHi = _mm256_slli_epi32(_mm256_unpackhi_epi16(r, zero), 15);
+    __m256i crLo = _mm256_add_epi32(_mm256_madd_epi16(gbLo, crGB), _mm256_add_epi32(rLo, cRound));
+    __m256i crHi = _mm256_add_epi32(_mm256_madd_epi16(gbHi, crGB), _mm256_add_epi32(rHi, cRound));
+    cr = _mm256_packs_epi32(_mm256_srai_epi32(crLo, 16), _mm256_srai_epi32(crHi, 16));
+}
+#endif
+#endif
+
+#ifdef PNG2JPG_SSE2
+// Stores eight converted chroma samples, or the sums of their four pairs
+template <bool SumPairs>
+static inline void storeChroma(int16_t* dst, __m128i c) {
+    if constexpr (SumPairs) {
+        __m128i sums = _mm_madd_epi16(c, _mm_set1_epi16(1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(sums, sums));
+    } else {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), c);
+    }
+}
+
+#ifdef __AVX2__
+template <bool SumPairs>
+static inline void storeChroma(int16_t* dst, __m256i c) {
+    if constexpr (SumPairs) {
+        __m256i sums = _mm256_madd_epi16(c, _mm256_set1_epi16(1));
+        // The in-lane pack leaves the eight sums in quadwords 0 and 2
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sums, sums), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(packed));
+    } else {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), c);
+    }
+}
+#endif
+#endif
+
+template <bool SumPairs>
+static void convertRow(const uint8_t* r, const uint8_t* g, const uint8_t* b,
+                       int16_t* y, int16_t* cb, int16_t* cr, uint32_t width) {
+    const int shift = SumPairs ? 1 : 0;
+    uint32_t x = 0;
+#ifdef __AVX2__
+    for (; x + 16 <= width; x += 16) {
+        __m256i vy, vcb, vcr;
+        rgbToYCbCrVec(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x))),
+            vy, vcb, vcr);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + x), vy);
+        storeChroma<SumPairs>(cb + (x >> shift), vcb);
+        storeChroma<SumPairs>(cr + (x >> shift), vcr);
+    }
+#endif
+#ifdef PNG2JPG_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= width; x += 8) {
+        __m128i vy, vcb, vcr;
+        rgbToYCbCrVec(
+            _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(r + x)), zero),
+            _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(g + x)), zero),
+            _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + x)), zero),
+            vy, vcb, vcr);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + x), vy);
+        storeChroma<SumPairs>(cb + (x >> shift), vcb);
+        storeChroma<SumPairs>(cr + (x >> shift), vcr);
+    }
+#endif
+    if constexpr (SumPairs) {
+        for (; x < width; x += 2) {
+            int16_t cb0, cr0, cb1, cr1;
+            rgbToYCbCrPixel(r[x], g[x], b[x], y[x], cb0, cr0);
+            if (x + 1 < width) {
+                rgbToYCbCrPixel(r[x + 1], g[x + 1], b[x + 1], y[x + 1], cb1, cr1);
+            } else {
+                cb1 = cb0;
+                cr1 = cr0;
             }
-            float cu = (u == 0) ? 1.0f / std::sqrt(2.0f) : 1.0f;
-            float cv = (v == 0) ? 1.0f / std::sqrt(2.0f) : 1.0f;
-            temp[u][v] = 0.25f * cu * cv * sum;
+            cb[x >> 1] = static_cast<int16_t>(cb0 + cb1);
+            cr[x >> 1] = static_cast<int16_t>(cr0 + cr1);
+        }
+    } else {
+        for (; x < width; x++) {
+            rgbToYCbCrPixel(r[x], g[x], b[x], y[x], cb[x], cr[x]);
         }
     }
+}
+
+void JPEGEncoder::rgbToYCbCr(const uint8_t* r, const uint8_t* g, const uint8_t* b,
+                             int16_t* y, int16_t* cb, int16_t* cr, uint32_t width, bool sumPairs) {
+    if (sumPairs) {
+        convertRow<true>(r, g, b, y, cb, cr, width);
+    } else {
+        convertRow<false>(r, g, b, y, cb, cr, width);
+    }
+}
+
+void JPEGEncoder::rgbToY(const uint8_t* r, const uint8_t* g, const uint8_t* b, int16_t* y,
+                         uint32_t width) {
+    uint32_t x = 0;
+#ifdef __AVX2__
+    for (; x + 16 <= width; x += 16) {
+        __m256i vy = rgbToYVec(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x))),
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x))));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + x), vy);
+    }
+#endif
+#ifdef PNG2JPG_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= width; x += 8) {
+        __m128i vy = rgbToYVec(
+            _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(r + x)), zero),
+            _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(g + x)), zero),
+            _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + x)), zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + x), vy);
+    }
+#endif
+    for (; x < width; x++) {
+        y[x] = rgbToYPixel(r[x], g[x], b[x]);
+    }
+}
+
+// Arai-Agui-Nakajima factored DCT on 8 values spaced `step` apart. Output k
+// comes out scaled by aanScale[k] / (2 sqrt 2) relative to the orthonormal
+// DCT; the scale is folded into the quantization divisors. T is float, or a
+// row of 8 floats to transform all columns of a block at once.
+template <typename T>
+static inline void fdct8Float(T* d, int step) {
+    T tmp0 = d[0 * step] + d[7 * step];
+    T tmp7 = d[0 * step] - d[7 * step];
+    T tmp1 = d[1 * step] + d[6 * step];
+    T tmp6 = d[1 * step] - d[6 * step];
+    T tmp2 = d[2 * step] + d[5 * step];
+    T tmp5 = d[2 * step] - d[5 * step];
+    T tmp3 = d[3 * step] + d[4 * step];
+    T tmp4 = d[3 * step] - d[4 * step];
+    
+    // Even part
+    T tmp10 = tmp0 + tmp3;
+    T tmp13 = tmp0 - tmp3;
+    T tmp11 = tmp1 + tmp2;
+    T tmp12 = tmp1 - tmp2;
+    
+    d[0 * step] = tmp10 + tmp11;
+    d[4 * step] = tmp10 - tmp11;
+    
+    T z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2 * step] = tmp13 + z1;
+    d[6 * step] = tmp13 - z1;
+    
+    // Odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    
+    T z5 = (tmp10 - tmp12) * 0.382683433f;
+    T z2 = tmp10 * 0.541196100f + z5;
+    T z4 = tmp12 * 1.306562965f + z5;
+    T z3 = tmp11 * 0.707106781f;
+    
+    T z11 = tmp7 + z3;
+    T z13 = tmp7 - z3;
+    
+    d[5 * step] = z13 + z2;
+    d[3 * step] = z13 - z2;
+    d[1 * step] = z11 + z4;
+    d[7 * step] = z11 - z4;
+}
+
+void JPEGEncoder::forwardDCTFloat(float block[64]) {
+    for (int i = 0; i < 8; i++) {
+        fdct8Float(block + i * 8, 1); // rows
+    }
+    for (int i = 0; i < 8; i++) {
+        fdct8Float(block + i, 8);     // columns
+    }
+}
+
+// Fixed-point constants for forwardDCTInt, scaled by 2^kConstBits
+static const int kConstBits = 13;
+static const int kPass1Bits = 2;
+static const int32_t FIX_0_298631336 = 2446;
+static const int32_t FIX_0_390180644 = 3196;
+static const int32_t FIX_0_541196100 = 4433;
+static const int32_t FIX_0_765366865 = 6270;
+static const int32_t FIX_0_899976223 = 7373;
+static const int32_t FIX_1_175875602 = 9633;
+static const int32_t FIX_1_501321110 = 12299;
+static const int32_t FIX_1_847759065 = 15137;
+static const int32_t FIX_1_961570560 = 16069;
+static const int32_t FIX_2_053119869 = 16819;
+static const int32_t FIX_2_562915447 = 20995;
+static const int32_t FIX_3_072711026 = 25172;
+
+static inline int32_t descale(int32_t x, int n) {
+    return (x + (int32_t(1) << (n - 1))) >> n;
+}
+
+// One pass of the Loeffler-Ligtenberg-Moschytz integer DCT (the "islow"
+// transform of the IJG code) on 8 values spaced `step` apart. The first pass
+// keeps kPass1Bits of extra precision and the second removes it again.
+template <bool FirstPass>
+static inline void fdct8Int(int32_t* d, int step) {
+    constexpr int evenShift = FirstPass ? 0 : kPass1Bits;
+    constexpr int oddShift = FirstPass ? kConstBits - kPass1Bits : kConstBits + kPass1Bits;
+    
+    int32_t tmp0 = d[0 * step] + d[7 * step];
+    int32_t tmp7 = d[0 * step] - d[7 * step];
+    int32_t tmp1 = d[1 * step] + d[6 * step];
+    int32_t tmp6 = d[1 * step] - d[6 * step];
+    int32_t tmp2 = d[2 * step] + d[5 * step];
+    int32_t tmp5 = d[2 * step] - d[5 * step];
+    int32_t tmp3 = d[3 * step] + d[4 * step];
+    int32_t tmp4 = d[3 * step] - d[4 * step];
+    
+    // Even part
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+    
+    if constexpr (FirstPass) {
+        d[0 * step] = (tmp10 + tmp11) * (1 << kPass1Bits);
+        d[4 * step] = (tmp10 - tmp11) * (1 << kPass1Bits);
+    } else {
+        d[0 * step] = descale(tmp10 + tmp11, evenShift);
+        d[4 * step] = descale(tmp10 - tmp11, evenShift);
+    }
+    
+    int32_t z1 = (tmp12 + tmp13) * FIX_0_541196100;
+    d[2 * step] = descale(z1 + tmp13 * FIX_0_765366865, oddShift);
+    d[6 * step] = descale(z1 - tmp12 * FIX_1_847759065, oddShift);
+    
+    // Odd part
+    z1 = tmp4 + tmp7;
+    int32_t z2 = tmp5 + tmp6;
+    int32_t z3 = tmp4 + tmp6;
+    int32_t z4 = tmp5 + tmp7;
+    int32_t z5 = (z3 + z4) * FIX_1_175875602;
+    
+    tmp4 *= FIX_0_298631336;
+    tmp5 *= FIX_2_053119869;
+    tmp6 *= FIX_3_072711026;
+    tmp7 *= FIX_1_501321110;
+    z1 *= -FIX_0_899976223;
+    z2 *= -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+    
+    d[7 * step] = descale(tmp4 + z1 + z3, oddShift);
+    d[5 * step] = descale(tmp5 + z2 + z4, oddShift);
+    d[3 * step] = descale(tmp6 + z2 + z3, oddShift);
+    d[1 * step] = descale(tmp7 + z1 + z4, oddShift);
+}
+
+void JPEGEncoder::forwardDCTInt(int32_t block[64]) {
+    for (int i = 0; i < 8; i++) {
+        fdct8Int<true>(block + i * 8, 1);
+    }
+    for (int i = 0; i < 8; i++) {
+        fdct8Int<false>(block + i, 8);
+    }
+}
+
+// AAN output scale per frequency: 1 for DC, cos(k pi / 16) * sqrt(2) else
+static const double kAANScale[8] = {
+    1.0, 1.387039845, 1.306562965, 1.175875602,
+    1.0, 0.785694958, 0.541196100, 0.275899379
+};
+
+// Smallest quantizer step outside the pruned corner for which a pruning level
+// is tried at all; below it the energy check passes too rarely to pay off
+static const int kMinPrunedStep = 8;
+
+void JPEGEncoder::buildQuantTable(const int baseTable[64], int quality, QuantTable& table) {
+    int scale = (quality < 50) ? (5000 / quality) : (200 - quality * 2);
+    
+    int minAC = 255, minOutside4x4 = 255;
+    for (int i = 0; i < 64; i++) {
+        int q = std::max(1, std::min(255, (baseTable[i] * scale + 50) / 100));
+        table.values[i] = q;
+        // Both transforms leave a further factor of 8 in their output
+        table.reciprocals[i] = static_cast<float>(1.0 / (q * kAANScale[i / 8] * kAANScale[i % 8] * 8.0));
+        table.divisors[i] = q * 8;
+        
+        if (i > 0) minAC = std::min(minAC, q);
+        if (i / 8 >= 4 || i % 8 >= 4) minOutside4x4 = std::min(minOutside4x4, q);
+    }
+    
+    // An orthonormal coefficient below q / 2 quantizes to zero, and by
+    // Parseval no single coefficient exceeds the root of the energy left over
+    // outside the computed ones. The 0.95 covers float rounding.
+    table.dcOnlyLimit = minAC >= kMinPrunedStep ? 0.95f * (minAC / 2.0f) * (minAC / 2.0f) : 0.0f;
+    table.low4x4Limit = minOutside4x4 >= kMinPrunedStep
+                      ? 0.95f * (minOutside4x4 / 2.0f) * (minOutside4x4 / 2.0f) : 0.0f;
+}
+
+void JPEGEncoder::quantizeFloat(const float block[64], const QuantTable& table, int output[64]) {
+    // Round to nearest, like the vector conversion in transformBlocksFloat
+    for (int i = 0; i < 64; i++) {
+        output[i] = static_cast<int>(std::lrint(block[ZIGZAG[i]] * table.reciprocals[ZIGZAG[i]]));
+    }
+}
+
+#ifdef PNG2JPG_SSE2
+// One row of a block: eight floats in an AVX register or in two SSE ones
+struct Float8 {
+#ifdef __AVX2__
+    __m256 v;
+    
+    static Float8 load(const float* p) { return {_mm256_loadu_ps(p)}; }
+    static Float8 load(const int16_t* p) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return {_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v))};
+    }
+    void storeRounded(int32_t* p) const {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(p), _mm256_cvtps_epi32(v));
+    }
+    Float8 operator+(Float8 b) const { return {_mm256_add_ps(v, b.v)}; }
+    Float8 operator-(Float8 b) const { return {_mm256_sub_ps(v, b.v)}; }
+    Float8 operator*(Float8 b) const { return {_mm256_mul_ps(v, b.v)}; }
+    Float8 operator*(float b) const { return {_mm256_mul_ps(v, _mm256_set1_ps(b))}; }
+#else
+    __m128 lo, hi;
+    
+    static Float8 load(const float* p) { return {_mm_loadu_ps(p), _mm_loadu_ps(p + 4)}; }
+    static Float8 load(const int16_t* p) {
+        // Sign-extend by unpacking each value into the top of a 32-bit lane
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return {_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)),
+                _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16))};
+    }
+    void storeRounded(int32_t* p) const {
+        _mm_store_si128(reinterpret_cast<__m128i*>(p), _mm_cvtps_epi32(lo));
+        _mm_store_si128(reinterpret_cast<__m128i*>(p + 4), _mm_cvtps_epi32(hi));
+    }
+    Float8 operator+(Float8 b) const { return {_mm_add_ps(lo, b.lo), _mm_add_ps(hi, b.hi)}; }
+    Float8 operator-(Float8 b) const { return {_mm_sub_ps(lo, b.lo), _mm_sub_ps(hi, b.hi)}; }
+    Float8 operator*(Float8 b) const { return {_mm_mul_ps(lo, b.lo), _mm_mul_ps(hi, b.hi)}; }
+    Float8 operator*(float b) const {
+        __m128 s = _mm_set1_ps(b);
+        return {_mm_mul_ps(lo, s), _mm_mul_ps(hi, s)};
+    }
+#endif
+};
+
+static inline void transpose8x8(Float8 r[8]) {
+#ifdef __AVX2__
+    __m256 t0 = _mm256_unpacklo_ps(r[0].v, r[1].v);
+    __m256 t1 = _mm256_unpackhi_ps(r[0].v, r[1].v);
+    __m256 t2 = _mm256_unpacklo_ps(r[2].v, r[3].v);
+    __m256 t3 = _mm256_unpackhi_ps(r[2].v, r[3].v);
+    __m256 t4 = _mm256_unpacklo_ps(r[4].v, r[5].v);
+    __m256 t5 = _mm256_unpackhi_ps(r[4].v, r[5].v);
+    __m256 t6 = _mm256_unpacklo_ps(r[6].v, r[7].v);
+    __m256 t7 = _mm256_unpackhi_ps(r[6].v, r[7].v);
+    __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0].v = _mm256_permute2f128_ps(u0, u4, 0x20);
+    r[1].v = _mm256_permute2f128_ps(u1, u5, 0x20);
+    r[2].v = _mm256_permute2f128_ps(u2, u6, 0x20);
+    r[3].v = _mm256_permute2f128_ps(u3, u7, 0x20);
+    r[4].v = _mm256_permute2f128_ps(u0, u4, 0x31);
+    r[5].v = _mm256_permute2f128_ps(u1, u5, 0x31);
+    r[6].v = _mm256_permute2f128_ps(u2, u6, 0x31);
+    r[7].v = _mm256_permute2f128_ps(u3, u7, 0x31);
+#else
+    // Transpose the four 4x4 quadrants, swapping the off-diagonal ones
+    _MM_TRANSPOSE4_PS(r[0].lo, r[1].lo, r[2].lo, r[3].lo);
+    _MM_TRANSPOSE4_PS(r[0].hi, r[1].hi, r[2].hi, r[3].hi);
+    _MM_TRANSPOSE4_PS(r[4].lo, r[5].lo, r[6].lo, r[7].lo);
+    _MM_TRANSPOSE4_PS(r[4].hi, r[5].hi, r[6].hi, r[7].hi);
+    for (int i = 0; i < 4; i++) {
+        std::swap(r[i].hi, r[i + 4].lo);
+    }
+#endif
+}
+// Four floats, used for the second pass of the pruned transform
+struct Float4 {
+    __m128 v;
+    
+    Float4 operator+(Float4 b) const { return {_mm_add_ps(v, b.v)}; }
+    Float4 operator-(Float4 b) const { return {_mm_sub_ps(v, b.v)}; }
+    Float4 operator*(Float4 b) const { return {_mm_mul_ps(v, b.v)}; }
+    Float4 operator*(float b) const { return {_mm_mul_ps(v, _mm_set1_ps(b))}; }
+};
+
+static inline float horizontalSum(__m128 v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+static inline float horizontalSum(const Float8& a) {
+#ifdef __AVX2__
+    return horizontalSum(_mm_add_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1)));
+#else
+    return horizontalSum(_mm_add_ps(a.lo, a.hi));
+#endif
+}
+
+static inline __m128 lowHalf(const Float8& a) {
+#ifdef __AVX2__
+    return _mm256_castps256_ps128(a.v);
+#else
+    return a.lo;
+#endif
+}
+
+static inline __m128 highHalf(const Float8& a) {
+#ifdef __AVX2__
+    return _mm256_extractf128_ps(a.v, 1);
+#else
+    return a.hi;
+#endif
+}
+
+// Natural-order position -> zigzag index
+static const uint8_t* naturalToZigzag(const int zigzag[64]) {
+    static uint8_t table[64];
+    static bool built = [&] {
+        for (int i = 0; i < 64; i++) table[zigzag[i]] = static_cast<uint8_t>(i);
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+// Second pass of the transform for the top-left 4x4 coefficients only. `rows`
+// holds the first (horizontal) pass, one row per frequency v. Succeeds, and
+// writes the block, if the energy not accounted for by the 4x4 corner is too
+// small for any other coefficient to survive quantization.
+static bool transformLow4x4(const Float8 rows[8], float energy, float limit,
+                            const float* reciprocals, const uint8_t* toZigzag, int* output,
+                            uint64_t& mask) {
+    static const Float4 toOrthonormal[4] = {
+        {_mm_setr_ps(float(1 / (8 * kAANScale[0] * kAANScale[0])), float(1 / (8 * kAANScale[0] * kAANScale[1])),
+                     float(1 / (8 * kAANScale[0] * kAANScale[2])), float(1 / (8 * kAANScale[0] * kAANScale[3])))},
+        {_mm_setr_ps(float(1 / (8 * kAANScale[1] * kAANScale[0])), float(1 / (8 * kAANScale[1] * kAANScale[1])),
+                     float(1 / (8 * kAANScale[1] * kAANScale[2])), float(1 / (8 * kAANScale[1] * kAANScale[3])))},
+        {_mm_setr_ps(float(1 / (8 * kAANScale[2] * kAANScale[0])), float(1 / (8 * kAANScale[2] * kAANScale[1])),
+                     float(1 / (8 * kAANScale[2] * kAANScale[2])), float(1 / (8 * kAANScale[2] * kAANScale[3])))},
+        {_mm_setr_ps(float(1 / (8 * kAANScale[3] * kAANScale[0])), float(1 / (8 * kAANScale[3] * kAANScale[1])),
+                     float(1 / (8 * kAANScale[3] * kAANScale[2])), float(1 / (8 * kAANScale[3] * kAANScale[3])))},
+    };
+    
+    // Columns y of the four low horizontal frequencies, lanes v = 0..3
+    Float4 cols[8];
+    for (int i = 0; i < 4; i++) {
+        cols[i].v = lowHalf(rows[i]);
+        cols[i + 4].v = highHalf(rows[i]);
+    }
+    _MM_TRANSPOSE4_PS(cols[0].v, cols[1].v, cols[2].v, cols[3].v);
+    _MM_TRANSPOSE4_PS(cols[4].v, cols[5].v, cols[6].v, cols[7].v);
+    fdct8Float(cols, 1);
     
+    __m128 lowEnergy = _mm_setzero_ps();
+    for (int u = 0; u < 4; u++) {
+        __m128 c = _mm_mul_ps(cols[u].v, toOrthonormal[u].v);
+        lowEnergy = _mm_add_ps(lowEnergy, _mm_mul_ps(c, c));
+    }
+    if (energy - horizontalSum(lowEnergy) >= limit) {
+        return false;
+    }
+    
+    alignas(16) int32_t low[16];
+    for (int u = 0; u < 4; u++) {
+        __m128 q = _mm_mul_ps(cols[u].v, _mm_loadu_ps(reciprocals + u * 8));
+        _mm_store_si128(reinterpret_cast<__m128i*>(low + u * 4), _mm_cvtps_epi32(q));
+    }
+    std::memset(output, 0, 64 * sizeof(int));
+    mask = 0;
+    for (int u = 0; u < 4; u++) {
+        for (int v = 0; v < 4; v++) {
+            int index = toZigzag[u * 8 + v];
+            output[index] = low[u * 4 + v];
+            mask |= uint64_t(low[u * 4 + v] != 0) << index;
+        }
+    }
+    return true;
+}
+#endif
+
+uint64_t JPEGEncoder::nonzeroMask(const int block[64]) {
+    uint64_t mask = 0;
+#ifdef PNG2JPG_SSE2
+    // Saturating packs keep nonzero values nonzero, so sixteen coefficients
+    // at a time narrow to bytes for one compare and movemask
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 64; i += 16) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(block + i);
+        __m128i lo = _mm_packs_epi32(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        __m128i hi = _mm_packs_epi32(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+        int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_packs_epi16(lo, hi), zero));
+        mask |= uint64_t(~zeros & 0xFFFF) << i;
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        mask |= uint64_t(block[i] != 0) << i;
+    }
+#endif
+    return mask;
+}
+
+void JPEGEncoder::transformBlocksFloat(const int16_t* samples, size_t stride, uint32_t count,
+                                       const QuantTable& table, bool prune, int* output,
+                                       uint64_t* masks) {
+#ifdef PNG2JPG_SSE2
+    // Each 1-D pass transforms all eight columns of the block at once; the
+    // transposes in between turn rows into columns and back
+    Float8 reciprocals[8];
     for (int i = 0; i < 8; i++) {
-        for (int j = 0; j < 8; j++) {
-            block[i][j] = temp[i][j];
+        reciprocals[i] = Float8::load(table.reciprocals + i * 8);
+    }
+    const uint8_t* toZigzag = naturalToZigzag(ZIGZAG);
+    
+    alignas(32) int32_t natural[64];
+    for (uint32_t b = 0; b < count; b++, samples += 8, output += 64, masks++) {
+        Float8 rows[8];
+        for (int y = 0; y < 8; y++) {
+            rows[y] = Float8::load(samples + y * stride);
+        }
+        
+        // Pruned levels: a block that is flat enough needs only its DC, one
+        // that is smooth enough only the top-left 4x4 coefficients
+        float energy = 0.0f;
+        if (prune) {
+            Float8 sum = rows[0];
+            Float8 squares = rows[0] * rows[0];
+            for (int y = 1; y < 8; y++) {
+                sum = sum + rows[y];
+                squares = squares + rows[y] * rows[y];
+            }
+            float total = horizontalSum(sum);
+            energy = horizontalSum(squares);
+            
+            float dc = total * 0.125f; // orthonormal DC
+            if (energy - dc * dc < table.dcOnlyLimit) {
+                std::memset(output, 0, 64 * sizeof(int));
+                output[0] = static_cast<int>(std::lrint(total * table.reciprocals[0]));
+                *masks = output[0] != 0;
+                continue;
+            }
+        }
+        
+        transpose8x8(rows);
+        fdct8Float(rows, 1);
+        
+        if (prune && table.low4x4Limit > 0.0f &&
+            transformLow4x4(rows, energy, table.low4x4Limit, table.reciprocals, toZigzag, output,
+                            *masks)) {
+            continue;
+        }
+        
+        transpose8x8(rows);
+        fdct8Float(rows, 1);
+        
+        for (int u = 0; u < 8; u++) {
+            (rows[u] * reciprocals[u]).storeRounded(natural + u * 8);
+        }
+        for (int i = 0; i < 64; i++) {
+            output[i] = natural[ZIGZAG[i]];
+        }
+        *masks = nonzeroMask(output);
+    }
+#else
+    // Pruning needs the vector kernels; every block gets the full transform
+    (void)prune;
+    for (uint32_t b = 0; b < count; b++, samples += 8, output += 64, masks++) {
+        float block[64];
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < 8; x++) {
+                block[y * 8 + x] = samples[y * stride + x];
+            }
         }
+        forwardDCTFloat(block);
+        quantizeFloat(block, table, output);
+        *masks = nonzeroMask(output);
     }
+#endif
 }
 
-void JPEGEncoder::quantize(float block[8][8], const int quantTable[64], int output[64]) {
+void JPEGEncoder::quantizeInt(const int32_t block[64], const QuantTable& table, int output[64]) {
+    // Rounds half away from zero, as IJG libjpeg does. The float path
+    // rounds halves to even instead, so the two can differ by one on an
+    // exact .5 quotient.
     for (int i = 0; i < 64; i++) {
-        int x = ZIGZAG[i] / 8;
-        int y = ZIGZAG[i] % 8;
-        output[i] = static_cast<int>(std::round(block[x][y] / quantTable[ZIGZAG[i]]));
+        int32_t value = block[ZIGZAG[i]];
+        int32_t divisor = table.divisors[ZIGZAG[i]];
+        if (value < 0) {
+            output[i] = -((-value + (divisor >> 1)) / divisor);
+        } else {
+            output[i] = (value + (divisor >> 1)) / divisor;
+        }
     }
 }
 
@@ -189,15 +885,16 @@ void JPEGEncoder::writeDQT(std::vector<uint8_t>& out, const int table[64], int t
     out.push_back(tableId);
     // Table values in zigzag order
     for (int i = 0; i < 64; i++) {
-        out.push_back(static_cast<uint8_t>(table[i]));
+        out.push_back(static_cast<uint8_t>(table[ZIGZAG[i]]));
     }
 }
 
-void JPEGEncoder::writeSOF0(std::vector<uint8_t>& out, uint32_t width, uint32_t height) {
+void JPEGEncoder::writeSOF0(std::vector<uint8_t>& out, uint32_t width, uint32_t height,
+                            int components, int hFactor, int vFactor) {
     writeMarker(out, 0xC0);
     // Length
     out.push_back(0x00);
-    out.push_back(0x11);
+    out.push_back(static_cast<uint8_t>(8 + 3 * components));
     // Precision
     out.push_back(0x08);
     // Height
@@ -207,11 +904,14 @@ void JPEGEncoder::writeSOF0(std::vector<uint8_t>& out, uint32_t width, uint32_t
     out.push_back((width >> 8) & 0xFF);
     out.push_back(width & 0xFF);
     // Number of components
-    out.push_back(0x03);
+    out.push_back(static_cast<uint8_t>(components));
     // Y component
     out.push_back(0x01); // ID
-    out.push_back(0x11); // Sampling factor (1x1)
+    out.push_back(static_cast<uint8_t>(hFactor << 4 | vFactor)); // Sampling factor
     out.push_back(0x00); // Quantization table ID
+    if (components == 1) {
+        return;
+    }
     // Cb component
     out.push_back(0x02);
     out.push_back(0x11);
@@ -222,67 +922,103 @@ void JPEGEncoder::writeSOF0(std::vector<uint8_t>& out, uint32_t width, uint32_t
     out.push_back(0x01);
 }
 
-void JPEGEncoder::writeDHT(std::vector<uint8_t>& out, const uint8_t* bits, 
-                            const uint8_t* values, int tcth, int count) {
+void JPEGEncoder::writeDHT(std::vector<uint8_t>& out, const HuffmanTable& table, int tcth) {
     writeMarker(out, 0xC4);
     // Length
-    int len = 19 + count;
+    int len = 19 + table.count;
     out.push_back((len >> 8) & 0xFF);
     out.push_back(len & 0xFF);
     // Table class and ID
     out.push_back(tcth);
     // Number of codes per length
     for (int i = 0; i < 16; i++) {
-        out.push_back(bits[i]);
+        out.push_back(table.bits[i]);
     }
     // Values
-    for (int i = 0; i < count; i++) {
-        out.push_back(values[i]);
+    for (int i = 0; i < table.count; i++) {
+        out.push_back(table.values[i]);
     }
 }
 
-void JPEGEncoder::writeSOS(std::vector<uint8_t>& out) {
+void JPEGEncoder::writeSOS(std::vector<uint8_t>& out, int components) {
     writeMarker(out, 0xDA);
     // Length
     out.push_back(0x00);
-    out.push_back(0x0C);
+    out.push_back(static_cast<uint8_t>(6 + 2 * components));
     // Number of components
-    out.push_back(0x03);
+    out.push_back(static_cast<uint8_t>(components));
     // Component 1 (Y)
     out.push_back(0x01);
     out.push_back(0x00); // DC/AC Huffman table
-    // Component 2 (Cb)
-    out.push_back(0x02);
-    out.push_back(0x11);
-    // Component 3 (Cr)
-    out.push_back(0x03);
-    out.push_back(0x11);
+    if (components == 3) {
+        // Component 2 (Cb)
+        out.push_back(0x02);
+        out.push_back(0x11);
+        // Component 3 (Cr)
+        out.push_back(0x03);
+        out.push_back(0x11);
+    }
     // Spectral selection
     out.push_back(0x00);
     out.push_back(0x3F);
     out.push_back(0x00);
 }
 
+void JPEGEncoder::writeDRI(std::vector<uint8_t>& out, uint32_t interval) {
+    writeMarker(out, 0xDD);
+    // Length
+    out.push_back(0x00);
+    out.push_back(0x04);
+    // MCUs per restart interval
+    out.push_back((interval >> 8) & 0xFF);
+    out.push_back(interval & 0xFF);
+}
+
+static inline int countTrailingZeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(value);
+#else
+    int count = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
 int JPEGEncoder::getCategory(int value) {
-    if (value == 0) return 0;
-    int absVal = std::abs(value);
+    // Number of significant bits of |value|
+    uint32_t magnitude = static_cast<uint32_t>(value < 0 ? -value : value);
+#if defined(__GNUC__) || defined(__clang__)
+    return magnitude ? 32 - __builtin_clz(magnitude) : 0;
+#else
     int cat = 0;
-    while (absVal > 0) {
-        absVal >>= 1;
+    while (magnitude > 0) {
+        magnitude >>= 1;
         cat++;
     }
     return cat;
+#endif
 }
 
-void JPEGEncoder::generateHuffmanCodes(const uint8_t* bits, const uint8_t* values,
-                                        uint16_t* codes, uint8_t* sizes) {
+void JPEGEncoder::buildHuffmanTable(const uint8_t* bits, const uint8_t* values, HuffmanTable& table) {
+    std::memcpy(table.bits, bits, 16);
+    table.count = 0;
+    for (int i = 0; i < 16; i++) {
+        table.count += bits[i];
+    }
+    std::memcpy(table.values, values, table.count);
+    std::memset(table.codes, 0, sizeof(table.codes));
+    std::memset(table.sizes, 0, sizeof(table.sizes));
+    
+    // Canonical code assignment (Annex C)
     int k = 0;
     uint16_t code = 0;
-    
     for (int i = 0; i < 16; i++) {
         for (int j = 0; j < bits[i]; j++) {
-            sizes[values[k]] = i + 1;
-            codes[values[k]] = code;
+            table.sizes[values[k]] = i + 1;
+            table.codes[values[k]] = code;
             code++;
             k++;
         }
@@ -290,159 +1026,899 @@ void JPEGEncoder::generateHuffmanCodes(const uint8_t* bits, const uint8_t* value
     }
 }
 
-void JPEGEncoder::encodeBlock(BitWriter& writer, int block[64], int& prevDC,
-                               const uint8_t* dcBits, const uint8_t* dcValues,
-                               const uint8_t* acBits, const uint8_t* acValues) {
-    uint16_t dcCodes[256] = {0};
-    uint8_t dcSizes[256] = {0};
-    uint16_t acCodes[256] = {0};
-    uint8_t acSizes[256] = {0};
+void JPEGEncoder::buildOptimalHuffmanTable(uint64_t freq[257], HuffmanTable& table) {
+    // Symbol 256 is a placeholder with the lowest frequency; it takes the
+    // all-ones code of the longest length, which JPEG does not allow
+    int codeSize[257] = {};
+    int others[257];
+    std::fill(others, others + 257, -1);
+    freq[256] = 1;
+    
+    // Repeatedly merge the two least frequent trees, growing the codes of
+    // all their symbols by one bit
+    while (true) {
+        int c1 = -1;
+        int c2 = -1;
+        uint64_t v1 = UINT64_MAX;
+        uint64_t v2 = UINT64_MAX;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] == 0) {
+                continue;
+            }
+            if (freq[i] <= v1) {
+                c2 = c1;
+                v2 = v1;
+                c1 = i;
+                v1 = freq[i];
+            } else if (freq[i] <= v2) {
+                c2 = i;
+                v2 = freq[i];
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+        
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codeSize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codeSize[c1]++;
+        }
+        others[c1] = c2;
+        codeSize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codeSize[c2]++;
+        }
+    }
+    
+    int lengthCount[257] = {};
+    for (int i = 0; i <= 256; i++) {
+        lengthCount[codeSize[i]]++;
+    }
+    
+    // Limit the lengths to 16 bits: a pair of codes at the longest length is
+    // replaced by one a bit shorter, and a shorter code splits in two
+    for (int i = 256; i > 16; i--) {
+        while (lengthCount[i] > 0) {
+            int j = i - 2;
+            while (lengthCount[j] == 0) {
+                j--;
+            }
+            lengthCount[i] -= 2;
+            lengthCount[i - 1]++;
+            lengthCount[j + 1] += 2;
+            lengthCount[j]--;
+        }
+    }
+    
+    // Drop the placeholder from the longest length
+    int longest = 16;
+    while (lengthCount[longest] == 0) {
+        longest--;
+    }
+    lengthCount[longest]--;
+    
+    // Symbols in order of their unlimited code length, then value; the
+    // limited lengths are handed out in that order
+    uint8_t bits[16];
+    for (int length = 1; length <= 16; length++) {
+        bits[length - 1] = static_cast<uint8_t>(lengthCount[length]);
+    }
+    uint8_t values[256];
+    int k = 0;
+    for (int length = 1; length <= 256; length++) {
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (codeSize[symbol] == length) {
+                values[k++] = static_cast<uint8_t>(symbol);
+            }
+        }
+    }
+    buildHuffmanTable(bits, values, table);
+}
+
+void JPEGEncoder::countBlock(const int block[64], uint64_t mask, int& prevDC, uint64_t* dcFreq,
+                             uint64_t* acFreq) {
+    // Mirrors encodeBlock()
+    dcFreq[getCategory(block[0] - prevDC)]++;
+    prevDC = block[0];
     
-    generateHuffmanCodes(dcBits, dcValues, dcCodes, dcSizes);
-    generateHuffmanCodes(acBits, acValues, acCodes, acSizes);
+    uint64_t nonzero = mask & ~uint64_t(1);
+    int last = 0;
+    while (nonzero) {
+        int i = countTrailingZeros(nonzero);
+        nonzero &= nonzero - 1;
+        
+        int run = i - last - 1;
+        acFreq[0xF0] += run >> 4;
+        acFreq[((run & 15) << 4) | getCategory(block[i])]++;
+        last = i;
+    }
     
-    // Encode DC coefficient
+    if (last != 63) {
+        acFreq[0x00]++;
+    }
+}
+
+void JPEGEncoder::encodeBlock(BitWriter& writer, const int block[64], uint64_t mask, int& prevDC,
+                              const HuffmanTable& dc, const HuffmanTable& ac) {
+    // Each symbol's code goes out together with the magnitude bits after it;
+    // negative values are sent as value - 1 in `cat` bits
     int dcDiff = block[0] - prevDC;
     prevDC = block[0];
     
     int dcCat = getCategory(dcDiff);
-    writer.writeBits(dcCodes[dcCat], dcSizes[dcCat]);
+    uint32_t dcBits = static_cast<uint32_t>(dcDiff - (dcDiff < 0)) & ((1u << dcCat) - 1);
+    writer.writeBits((uint32_t(dc.codes[dcCat]) << dcCat) | dcBits, dc.sizes[dcCat] + dcCat);
     
-    if (dcCat > 0) {
-        int dcVal = dcDiff;
-        if (dcDiff < 0) {
-            dcVal = dcDiff - 1;
+    // Walk the nonzero AC coefficients only; the zero run in front of each
+    // is the distance from the previous one
+    uint64_t nonzero = mask & ~uint64_t(1);
+    int last = 0;
+    while (nonzero) {
+        int i = countTrailingZeros(nonzero);
+        nonzero &= nonzero - 1;
+        
+        int run = i - last - 1;
+        for (int zrl = run >> 4; zrl > 0; zrl--) {
+            writer.writeBits(ac.codes[0xF0], ac.sizes[0xF0]); // ZRL
         }
-        writer.writeBits(dcVal & ((1 << dcCat) - 1), dcCat);
+        
+        int value = block[i];
+        int acCat = getCategory(value);
+        int symbol = ((run & 15) << 4) | acCat;
+        uint32_t acBits = static_cast<uint32_t>(value - (value < 0)) & ((1u << acCat) - 1);
+        writer.writeBits((uint32_t(ac.codes[symbol]) << acCat) | acBits, ac.sizes[symbol] + acCat);
+        last = i;
+    }
+    
+    if (last != 63) {
+        writer.writeBits(ac.codes[0x00], ac.sizes[0x00]); // EOB
     }
+}
+
+void JPEGEncoder::encode(const Image& image, const std::string& filename,
+                         const JPEGEncodeOptions& options) {
+    OutputStream out(filename);
+    encode(image, out, options);
+    out.close();
+}
+
+void JPEGEncoder::encode(const Image& image, OutputStream& out, const JPEGEncodeOptions& options) {
+    ScanlineEncoder encoder(out, options);
+    encoder.begin({image.width(), image.height(), image.channels()});
     
-    // Encode AC coefficients
-    int zeroCount = 0;
-    for (int i = 1; i < 64; i++) {
-        if (block[i] == 0) {
-            zeroCount++;
+    // The planes feed the color conversion directly; a gray row is already
+    // in the sink's single-channel layout
+    for (uint32_t y = 0; y < image.height(); y++) {
+        if (image.channels() == 1) {
+            encoder.row(y, image.row(0, y));
         } else {
-            while (zeroCount >= 16) {
-                writer.writeBits(acCodes[0xF0], acSizes[0xF0]); // ZRL
-                zeroCount -= 16;
-            }
-            
-            int acCat = getCategory(block[i]);
-            int symbol = (zeroCount << 4) | acCat;
-            writer.writeBits(acCodes[symbol], acSizes[symbol]);
-            
-            int acVal = block[i];
-            if (block[i] < 0) {
-                acVal = block[i] - 1;
-            }
-            writer.writeBits(acVal & ((1 << acCat) - 1), acCat);
-            
-            zeroCount = 0;
+            encoder.rowPlanar(image.row(0, y), image.row(1, y), image.row(2, y));
         }
     }
     
-    if (zeroCount > 0) {
-        writer.writeBits(acCodes[0x00], acSizes[0x00]); // EOB
+    encoder.end();
+}
+
+// Coded bytes of a scan without restart markers held before they are
+// written out
+static const size_t scanFlushBytes = 64 * 1024;
+
+JPEGEncoder::ScanlineEncoder::ScanlineEncoder(const std::string& filename,
+                                               const JPEGEncodeOptions& options)
+    : filename_(filename), options_(options), width_(0), height_(0), channels_(0),
+      components_(0), paddedWidth_(0), chromaWidth_(0), hShift_(0), vShift_(0), stripHeight_(8),
+      restartRows_(0), pipelined_(false), out_(nullptr), segmentsWritten_(0), stripRows_(0),
+      stopping_(false), inputDone_(false), split_(nullptr) {}
+
+JPEGEncoder::ScanlineEncoder::ScanlineEncoder(OutputStream& out, const JPEGEncodeOptions& options)
+    : ScanlineEncoder(out.name(), options) {
+    out_ = &out;
+}
+
+JPEGEncoder::ScanlineEncoder::~ScanlineEncoder() {
+    // Abandoned mid-image, e.g. by a decoding error; drop queued work
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.clear();
+        stopping_ = true;
+    }
+    segmentDone_.notify_all();
+    if (coder_.joinable()) {
+        coder_.join();
     }
+    stopWorkers();
 }
 
-void JPEGEncoder::encode(const Image& image, const std::string& filename, int quality) {
-    // Adjust quantization tables based on quality
-    int scaledLumQuant[64];
-    int scaledChromQuant[64];
+template <int Channels>
+void JPEGEncoder::ScanlineEncoder::splitRow(const uint8_t* src, uint8_t* r, uint8_t* g, uint8_t* b,
+                                            uint32_t width) {
+    // Alpha, if any, is the last channel and is dropped; gray rows only
+    // fill `r`
+    for (uint32_t x = 0; x < width; x++, src += Channels) {
+        r[x] = src[0];
+        if constexpr (Channels >= 3) {
+            g[x] = src[1];
+            b[x] = src[2];
+        }
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::begin(const ScanlineFormat& format) {
+    if (format.width == 0 || format.height == 0 || format.width > 0xFFFF ||
+        format.height > 0xFFFF) {
+        throw std::runtime_error("Image dimensions not supported by JPEG");
+    }
     
-    int scale = (quality < 50) ? (5000 / quality) : (200 - quality * 2);
+    switch (format.channels) {
+        case 1: split_ = &splitRow<1>; break;
+        case 2: split_ = &splitRow<2>; break;
+        case 3: split_ = &splitRow<3>; break;
+        case 4: split_ = &splitRow<4>; break;
+        default: throw std::runtime_error("Unsupported channel count");
+    }
     
-    for (int i = 0; i < 64; i++) {
-        scaledLumQuant[i] = std::max(1, std::min(255, (luminanceQuantTable[i] * scale + 50) / 100));
-        scaledChromQuant[i] = std::max(1, std::min(255, (chrominanceQuantTable[i] * scale + 50) / 100));
+    width_ = format.width;
+    height_ = format.height;
+    channels_ = format.channels;
+    components_ = channels_ <= 2 || options_.grayscale ? 1 : 3;
+    // A single-component scan is not interleaved; its MCU is one block
+    hShift_ = components_ == 1 || options_.subsampling == ChromaSubsampling::S444 ? 0 : 1;
+    vShift_ = components_ == 3 && options_.subsampling == ChromaSubsampling::S420 ? 1 : 0;
+    uint32_t mcuWidth = 8u << hShift_;
+    paddedWidth_ = ((width_ + mcuWidth - 1) / mcuWidth) * mcuWidth;
+    chromaWidth_ = paddedWidth_ >> hShift_;
+    stripHeight_ = 8u << vShift_;
+    
+    // The restart interval is counted in MCUs and has to fit 16 bits
+    uint32_t mcusPerStrip = chromaWidth_ / 8;
+    restartRows_ = std::min<uint32_t>(options_.restartRows, std::max(1u, 0xFFFF / mcusPerStrip));
+    
+    unsigned threads = options_.threads ? options_.threads
+                                        : std::max(1u, std::thread::hardware_concurrency());
+    pipelined_ = restartRows_ == 0 && threads > 1;
+    
+    for (int c = 0; c < 3; c++) {
+        planes_[c].resize(channels_ > 1 ? width_ : 0);
+    }
+    allocate(buffers_);
+    if (pipelined_) {
+        // Two strips per worker in flight, plus the one receiving rows and
+        // the one being coded
+        inputDone_ = false;
+        for (unsigned i = 0; i < 2 * threads + 2; i++) {
+            std::unique_ptr<Segment> strip(new Segment());
+            for (int c = 0; c < components_; c++) {
+                strip->samples[c].resize(size_t(stripWidth(c)) * stripHeight_);
+            }
+            allocate(strip->blocks);
+            free_.push_back(std::move(strip));
+        }
+        scan_.reset(new Segment());
+        if (!options_.optimizeHuffman) {
+            scan_->writer.start(scanFlushBytes + expectedBytes(1));
+        }
+    }
+    current_ = newSegment();
+    stripRows_ = 0;
+    
+    if (!out_) {
+        ownOutput_.reset(new OutputStream(filename_));
+        out_ = ownOutput_.get();
     }
     
-    std::vector<uint8_t> output;
+    // Adjust quantization tables based on quality
+    buildQuantTable(luminanceQuantTable, options_.quality, lumQuant_);
+    buildQuantTable(chrominanceQuantTable, options_.quality, chromQuant_);
     
     // SOI marker
-    writeMarker(output, 0xD8);
+    writeMarker(output_, 0xD8);
     
     // APP0 segment
-    writeAPP0(output);
+    writeAPP0(output_);
     
     // DQT segments
-    writeDQT(output, scaledLumQuant, 0);
-    writeDQT(output, scaledChromQuant, 1);
+    writeDQT(output_, lumQuant_.values, 0);
+    if (components_ == 3) {
+        writeDQT(output_, chromQuant_.values, 1);
+    }
     
     // SOF0 segment
-    writeSOF0(output, image.width(), image.height());
+    writeSOF0(output_, width_, height_, components_, 1 << hShift_, 1 << vShift_);
     
-    // DHT segments
-    writeDHT(output, dcLuminanceBits, dcLuminanceValues, 0x00, 12);
-    writeDHT(output, acLuminanceBits, acLuminanceValues, 0x10, 162);
-    writeDHT(output, dcChrominanceBits, dcChrominanceValues, 0x01, 12);
-    writeDHT(output, acChrominanceBits, acChrominanceValues, 0x11, 162);
+    // With optimizeHuffman the tables are only known once every block has
+    // been seen
+    if (!options_.optimizeHuffman) {
+        buildHuffmanTable(dcLuminanceBits, dcLuminanceValues, dcLum_);
+        buildHuffmanTable(acLuminanceBits, acLuminanceValues, acLum_);
+        buildHuffmanTable(dcChrominanceBits, dcChrominanceValues, dcChrom_);
+        buildHuffmanTable(acChrominanceBits, acChrominanceValues, acChrom_);
+        startScan();
+    }
+    writeOutput();
+    
+    if (threads > 1) {
+        stopping_ = false;
+        for (unsigned t = 0; t < threads; t++) {
+            workers_.emplace_back(&ScanlineEncoder::workerLoop, this);
+        }
+    }
+    if (pipelined_) {
+        coder_ = std::thread(&ScanlineEncoder::coderLoop, this);
+    }
+}
+
+size_t JPEGEncoder::ScanlineEncoder::workingSetBytes(const ScanlineFormat& format,
+                                                     const JPEGEncodeOptions& options) {
+    int components = format.channels <= 2 || options.grayscale ? 1 : 3;
+    int hShift = components == 1 || options.subsampling == ChromaSubsampling::S444 ? 0 : 1;
+    int vShift = components == 3 && options.subsampling == ChromaSubsampling::S420 ? 1 : 0;
+    uint32_t mcuWidth = 8u << hShift;
+    size_t paddedWidth = (size_t(format.width) + mcuWidth - 1) / mcuWidth * mcuWidth;
+    size_t chromaWidth = paddedWidth >> hShift;
+    size_t stripHeight = 8u << vShift;
+    size_t stripPixels = paddedWidth * stripHeight;
+    size_t strips = (size_t(format.height) + stripHeight - 1) / stripHeight;
+    
+    // One strip's samples and quantized blocks, with the masks
+    size_t sampleBytes = stripPixels * sizeof(int16_t);
+    size_t blockBytes = stripPixels * (sizeof(int) + sizeof(uint64_t) / 64);
+    if (components == 3) {
+        sampleBytes += 2 * chromaWidth * stripHeight * sizeof(int16_t);
+        blockBytes += 2 * chromaWidth * 8 * (sizeof(int) + sizeof(uint64_t) / 64);
+    }
+    size_t codedStrip = stripPixels / 4;
+    
+    unsigned threads = options.threads ? options.threads
+                                       : std::max(1u, std::thread::hardware_concurrency());
+    uint32_t mcusPerStrip = static_cast<uint32_t>(chromaWidth / 8);
+    uint32_t restartRows = std::min<uint32_t>(options.restartRows,
+                                              std::max(1u, 0xFFFF / std::max(1u, mcusPerStrip)));
+    
+    size_t bytes = (format.channels > 1 ? 3 * size_t(format.width) : 0) + blockBytes;
+    if (restartRows > 0) {
+        // Two segments per worker in flight and the one receiving rows
+        size_t segments = threads > 1 ? 2 * threads + 1 : 1;
+        bytes += segments * restartRows * (sampleBytes + codedStrip) + (threads - 1) * blockBytes;
+    } else if (threads > 1) {
+        // The ring of strips, plus the buffered scan
+        bytes += (2 * threads + 2) * (sampleBytes + blockBytes + codedStrip) +
+                 2 * (scanFlushBytes + codedStrip);
+    } else {
+        bytes += sampleBytes + 2 * (scanFlushBytes + codedStrip);
+    }
+    
+    if (options.optimizeHuffman) {
+        // The first pass keeps every block as its mask and nonzero
+        // coefficients, about 64 bytes with the vectors' slack, and the
+        // second codes the whole image at once
+        size_t blocks = strips * (stripPixels + (components == 3 ? 2 * chromaWidth * 8 : 0)) / 64;
+        bytes += blocks * 64 + strips * codedStrip;
+    }
+    return bytes;
+}
+
+void JPEGEncoder::ScanlineEncoder::startScan() {
+    // DHT segments, from the tables the blocks are coded with
+    writeDHT(output_, dcLum_, 0x00);
+    writeDHT(output_, acLum_, 0x10);
+    if (components_ == 3) {
+        writeDHT(output_, dcChrom_, 0x01);
+        writeDHT(output_, acChrom_, 0x11);
+    }
+    
+    // DRI segment
+    if (restartRows_ > 0) {
+        writeDRI(output_, restartRows_ * (chromaWidth_ / 8));
+    }
     
     // SOS segment
-    writeSOS(output);
+    writeSOS(output_, components_);
+}
+
+void JPEGEncoder::ScanlineEncoder::row(uint32_t, const uint8_t* samples) {
+    if (channels_ == 1) {
+        grayRow(samples);
+        return;
+    }
     
-    // Encode image data
-    BitWriter writer(output);
+    split_(samples, planes_[0].data(), planes_[1].data(), planes_[2].data(), width_);
+    if (channels_ == 2) {
+        grayRow(planes_[0].data());
+    } else {
+        rowPlanar(planes_[0].data(), planes_[1].data(), planes_[2].data());
+    }
+}
+
+int16_t* JPEGEncoder::ScanlineEncoder::rowSamples(int component) const {
+    size_t row = size_t(current_->strips) * stripHeight_ + stripRows_;
+    return current_->samples[component].data() + row * stripWidth(component);
+}
+
+void JPEGEncoder::ScanlineEncoder::rowPlanar(const uint8_t* r, const uint8_t* g, const uint8_t* b) {
+    if (components_ == 1) {
+        rgbToY(r, g, b, rowSamples(0), width_);
+    } else {
+        rgbToYCbCr(r, g, b, rowSamples(0), rowSamples(1), rowSamples(2), width_, hShift_ != 0);
+    }
+    finishRow();
+}
+
+void JPEGEncoder::ScanlineEncoder::grayRow(const uint8_t* gray) {
+    // Gray input is always coded as Y alone, which is the gray value
+    int16_t* y = rowSamples(0);
+    for (uint32_t x = 0; x < width_; x++) {
+        y[x] = static_cast<int16_t>(gray[x] - 128);
+    }
+    finishRow();
+}
+
+void JPEGEncoder::ScanlineEncoder::finishRow() {
+    // Replicate the last column into the padding of the final MCU
+    for (int c = 0; c < components_; c++) {
+        uint32_t used = c ? (width_ + (1u << hShift_) - 1) >> hShift_ : width_;
+        int16_t* line = rowSamples(c);
+        std::fill(line + used, line + stripWidth(c), line[used - 1]);
+    }
     
-    int prevDCY = 0, prevDCCb = 0, prevDCCr = 0;
+    if (++stripRows_ == stripHeight_) {
+        finishStrip();
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::finishStrip() {
+    stripRows_ = 0;
+    if (pipelined_) {
+        current_->strips = 1;
+        submit();
+        current_ = newSegment();
+    } else if (restartRows_ == 0) {
+        // One segment for the whole image, coded strip by strip
+        encodeStrip(*current_, 0, buffers_);
+        drainScan(*current_);
+    } else if (++current_->strips == restartRows_) {
+        submit();
+        current_ = newSegment();
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::end() {
+    if (stripRows_ > 0) {
+        // Replicate the last row into the padding of the final strip
+        for (int c = 0; c < components_; c++) {
+            int16_t* next = rowSamples(c);
+            const int16_t* last = next - stripWidth(c);
+            for (uint32_t y = stripRows_; y < stripHeight_; y++, next += stripWidth(c)) {
+                std::copy(last, last + stripWidth(c), next);
+            }
+        }
+        finishStrip();
+    }
     
-    uint32_t paddedWidth = ((image.width() + 7) / 8) * 8;
-    uint32_t paddedHeight = ((image.height() + 7) / 8) * 8;
+    if (pipelined_) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            inputDone_ = true;
+        }
+        segmentDone_.notify_all();
+        coder_.join();
+        stopWorkers();
+        if (pipelineError_) {
+            std::rethrow_exception(pipelineError_);
+        }
+        
+        current_ = std::move(scan_);
+        submit();
+    } else if (restartRows_ == 0 || current_->strips > 0) {
+        submit();
+    }
+    while (!pending_.empty()) {
+        retireOldest();
+    }
+    stopWorkers();
     
-    for (uint32_t blockY = 0; blockY < paddedHeight; blockY += 8) {
-        for (uint32_t blockX = 0; blockX < paddedWidth; blockX += 8) {
-            float yBlock[8][8], cbBlock[8][8], crBlock[8][8];
-            
-            // Extract 8x8 block
-            for (int y = 0; y < 8; y++) {
-                for (int x = 0; x < 8; x++) {
-                    uint32_t px = std::min(blockX + x, image.width() - 1);
-                    uint32_t py = std::min(blockY + y, image.height() - 1);
-                    
-                    const Pixel& pixel = image.at(px, py);
-                    float yVal, cbVal, crVal;
-                    rgbToYCbCr(pixel.r, pixel.g, pixel.b, yVal, cbVal, crVal);
-                    
-                    yBlock[y][x] = yVal - 128.0f;
-                    cbBlock[y][x] = cbVal - 128.0f;
-                    crBlock[y][x] = crVal - 128.0f;
+    if (options_.optimizeHuffman) {
+        // Second pass, with tables from the symbol counts of all segments
+        for (size_t i = 1; i < firstPass_.size(); i++) {
+            for (int t = 0; t < 2; t++) {
+                for (int k = 0; k < 257; k++) {
+                    firstPass_[0]->dcFreq[t][k] += firstPass_[i]->dcFreq[t][k];
+                    firstPass_[0]->acFreq[t][k] += firstPass_[i]->acFreq[t][k];
                 }
             }
-            
-            // DCT
-            forwardDCT(yBlock);
-            forwardDCT(cbBlock);
-            forwardDCT(crBlock);
-            
-            // Quantize
-            int yQuant[64], cbQuant[64], crQuant[64];
-            quantize(yBlock, scaledLumQuant, yQuant);
-            quantize(cbBlock, scaledChromQuant, cbQuant);
-            quantize(crBlock, scaledChromQuant, crQuant);
-            
-            // Encode
-            encodeBlock(writer, yQuant, prevDCY, 
-                       dcLuminanceBits, dcLuminanceValues,
-                       acLuminanceBits, acLuminanceValues);
-            encodeBlock(writer, cbQuant, prevDCCb,
-                       dcChrominanceBits, dcChrominanceValues,
-                       acChrominanceBits, acChrominanceValues);
-            encodeBlock(writer, crQuant, prevDCCr,
-                       dcChrominanceBits, dcChrominanceValues,
-                       acChrominanceBits, acChrominanceValues);
         }
+        buildOptimalHuffmanTable(firstPass_[0]->dcFreq[0], dcLum_);
+        buildOptimalHuffmanTable(firstPass_[0]->acFreq[0], acLum_);
+        if (components_ == 3) {
+            buildOptimalHuffmanTable(firstPass_[0]->dcFreq[1], dcChrom_);
+            buildOptimalHuffmanTable(firstPass_[0]->acFreq[1], acChrom_);
+        }
+        startScan();
+        for (std::unique_ptr<Segment>& segment : firstPass_) {
+            encodeBuffered(*segment);
+            appendSegment(*segment);
+            segment.reset();
+        }
+        firstPass_.clear();
     }
     
-    writer.flush();
-    
     // EOI marker
-    writeMarker(output, 0xD9);
+    writeMarker(output_, 0xD9);
+    writeOutput();
+    
+    if (ownOutput_) {
+        ownOutput_->close();
+    } else {
+        out_->flush();
+    }
+}
+
+std::unique_ptr<JPEGEncoder::ScanlineEncoder::Segment> JPEGEncoder::ScanlineEncoder::newSegment() {
+    if (pipelined_) {
+        // Wait for coder_ to hand a strip of the ring back
+        std::unique_lock<std::mutex> lock(mutex_);
+        slotFree_.wait(lock, [&]() { return !free_.empty(); });
+        std::unique_ptr<Segment> segment = std::move(free_.front());
+        free_.pop_front();
+        segment->strips = 0;
+        segment->done = false;
+        return segment;
+    }
+    
+    std::unique_ptr<Segment> segment(new Segment());
+    uint32_t strips = restartRows_ ? restartRows_ : 1;
+    for (int c = 0; c < components_; c++) {
+        if (spare_) {
+            segment->samples[c] = std::move(spare_->samples[c]);
+        }
+        segment->samples[c].resize(size_t(stripWidth(c)) * stripHeight_ * strips);
+    }
+    spare_.reset();
     
-    // Write to file
-    std::ofstream file(filename, std::ios::binary);
-    if (! file) {
-        throw std::runtime_error("Cannot create output file: " + filename);
+    if (!options_.optimizeHuffman) {
+        segment->writer.start(restartRows_ ? expectedBytes(restartRows_)
+                                           : scanFlushBytes + expectedBytes(1));
     }
-    file.write(reinterpret_cast<const char*>(output.data()), output.size());
-}
\ No newline at end of file
+    return segment;
+}
+
+void JPEGEncoder::ScanlineEncoder::allocate(StripBuffers& buffers) const {
+    for (int c = 0; c < components_; c++) {
+        // Chroma only transforms one band of blocks per strip
+        uint32_t bands = c ? 1 : stripHeight_ / 8;
+        buffers.coefficients[c].resize(size_t(stripWidth(c)) * 8 * bands);
+        buffers.masks[c].resize(stripWidth(c) / 8 * bands);
+    }
+}
+
+size_t JPEGEncoder::ScanlineEncoder::expectedBytes(uint32_t strips) const {
+    // Room for the coded data at a typical 4:1 over the pixel count; the
+    // writer grows the buffer beyond that
+    size_t pixels = size_t(width_) * std::min(height_, strips * stripHeight_);
+    return std::min<size_t>(pixels / 4, size_t(64) << 20);
+}
+
+void JPEGEncoder::ScanlineEncoder::submit() {
+    // Hands current_ over, to the workers if there are any. At most two
+    // segments per worker are in flight, to bound the memory held.
+    Segment* segment = current_.get();
+    if (pipelined_ && !inputDone_) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(std::move(current_));
+            queue_.push_back(segment);
+        }
+        workAvailable_.notify_one();
+        return;
+    }
+    
+    pending_.push_back(std::move(current_));
+    if (workers_.empty() || pipelined_) {
+        if (restartRows_ > 0) {
+            encodeSegment(*segment, buffers_);
+        }
+        segment->done = true;
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(segment);
+        }
+        workAvailable_.notify_one();
+    }
+    
+    while (pending_.size() > std::max<size_t>(1, 2 * workers_.size())) {
+        retireOldest();
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::retireOldest() {
+    // Segments are written in the order they were submitted
+    std::unique_ptr<Segment> segment = std::move(pending_.front());
+    pending_.pop_front();
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        segmentDone_.wait(lock, [&]() { return segment->done; });
+    }
+    if (segment->error) {
+        std::rethrow_exception(segment->error);
+    }
+    
+    if (options_.optimizeHuffman) {
+        for (std::vector<int16_t>& samples : segment->samples) {
+            std::vector<int16_t>().swap(samples);
+        }
+        firstPass_.push_back(std::move(segment));
+        return;
+    }
+    
+    segment->writer.flush();
+    appendSegment(*segment);
+    spare_ = std::move(segment);
+}
+
+void JPEGEncoder::ScanlineEncoder::appendSegment(Segment& segment) {
+    // RSTn markers go between segments, numbered modulo 8
+    if (segmentsWritten_ > 0) {
+        writeMarker(output_, static_cast<uint8_t>(0xD0 + (segmentsWritten_ - 1) % 8));
+    }
+    segmentsWritten_++;
+    writeOutput();
+    out_->write(segment.data.data(), segment.data.size());
+    std::vector<uint8_t>().swap(segment.data);
+}
+
+void JPEGEncoder::ScanlineEncoder::writeOutput() {
+    out_->write(output_.data(), output_.size());
+    output_.clear();
+}
+
+void JPEGEncoder::ScanlineEncoder::drainScan(Segment& segment) {
+    // A scan without restart markers is a single segment; its coded bytes
+    // go out as they pile up rather than all at the end
+    if (segment.writer.size() >= scanFlushBytes) {
+        out_->write(segment.data.data(), segment.writer.size());
+        segment.writer.discard();
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::workerLoop() {
+    // Pipelined strips bring their own buffers
+    StripBuffers buffers;
+    if (!pipelined_) {
+        allocate(buffers);
+    }
+    while (true) {
+        Segment* segment;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            workAvailable_.wait(lock, [&]() { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            segment = queue_.front();
+            queue_.pop_front();
+        }
+        
+        try {
+            if (pipelined_) {
+                transformStrip(*segment, 0, segment->blocks);
+            } else {
+                encodeSegment(*segment, buffers);
+            }
+        } catch (...) {
+            segment->error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            segment->done = true;
+        }
+        segmentDone_.notify_all();
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::coderLoop() {
+    while (true) {
+        std::unique_ptr<Segment> strip;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            segmentDone_.wait(lock, [&]() {
+                return stopping_ || (pending_.empty() ? inputDone_ : pending_.front()->done);
+            });
+            if (stopping_ || pending_.empty()) {
+                return;
+            }
+            strip = std::move(pending_.front());
+            pending_.pop_front();
+        }
+        
+        // After an error the remaining strips are only recycled
+        if (strip->error && !pipelineError_) {
+            pipelineError_ = strip->error;
+        }
+        if (!pipelineError_) {
+            try {
+                codeStrip(*scan_, strip->blocks);
+                drainScan(*scan_);
+            } catch (...) {
+                pipelineError_ = std::current_exception();
+            }
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            strip->error = nullptr;
+            free_.push_back(std::move(strip));
+        }
+        slotFree_.notify_one();
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    workAvailable_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+    workers_.clear();
+}
+
+void JPEGEncoder::ScanlineEncoder::encodeSegment(Segment& segment, StripBuffers& buffers) const {
+    for (uint32_t strip = 0; strip < segment.strips; strip++) {
+        encodeStrip(segment, strip, buffers);
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::downsampleChroma(int16_t* cb, int16_t* cr) const {
+    // Box filter: add up the rows of each MCU's chroma pairs (or single
+    // samples) and divide, with a bias alternating between columns as in
+    // IJG libjpeg so that the rounding does not drift either way
+    int shift = hShift_ + vShift_;
+    int baseBias = ((1 << shift) >> 1) - 1;
+    for (int16_t* plane : {cb, cr}) {
+        for (uint32_t y = 0; y < 8; y++) {
+            const int16_t* top = plane + size_t(y << vShift_) * chromaWidth_;
+            const int16_t* bottom = top + (vShift_ ? chromaWidth_ : 0);
+            int16_t* out = plane + size_t(y) * chromaWidth_;
+            for (uint32_t x = 0; x < chromaWidth_; x++) {
+                int sum = top[x] + (vShift_ ? bottom[x] : 0);
+                out[x] = static_cast<int16_t>((sum + baseBias + int(x & 1)) >> shift);
+            }
+        }
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::encodeStrip(Segment& segment, uint32_t strip,
+                                               StripBuffers& buffers) const {
+    transformStrip(segment, strip, buffers);
+    codeStrip(segment, buffers);
+}
+
+void JPEGEncoder::ScanlineEncoder::transformStrip(Segment& segment, uint32_t strip,
+                                                  StripBuffers& buffers) const {
+    int16_t* samples[3] = {};
+    for (int c = 0; c < components_; c++) {
+        samples[c] = segment.samples[c].data() + size_t(strip) * stripHeight_ * stripWidth(c);
+    }
+    
+    if (components_ == 3 && hShift_ + vShift_ > 0) {
+        downsampleChroma(samples[1], samples[2]);
+    }
+    
+    uint32_t bandBlocks = paddedWidth_ / 8;
+    for (uint32_t band = 0; band < stripHeight_ / 8; band++) {
+        transformBand(samples[0] + size_t(band) * 8 * paddedWidth_, paddedWidth_, lumQuant_,
+                      buffers.coefficients[0].data() + size_t(band) * bandBlocks * 64,
+                      buffers.masks[0].data() + band * bandBlocks);
+    }
+    for (int c = 1; c < components_; c++) {
+        transformBand(samples[c], chromaWidth_, chromQuant_, buffers.coefficients[c].data(),
+                      buffers.masks[c].data());
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::codeStrip(Segment& coder, const StripBuffers& buffers) const {
+    if (components_ == 1) {
+        // Blocks are coded in order, one per MCU
+        for (uint32_t b = 0; b < paddedWidth_ / 8; b++) {
+            codeBlock(coder, buffers, 0, b);
+        }
+        return;
+    }
+    
+    // Each MCU has the Y blocks of its 2x2, 2x1 or 1x1 area, row by row,
+    // then one Cb and one Cr block
+    uint32_t bandBlocks = paddedWidth_ / 8;
+    uint32_t mcus = chromaWidth_ / 8;
+    uint32_t mcuBlocks = 1u << hShift_;
+    for (uint32_t m = 0; m < mcus; m++) {
+        for (uint32_t band = 0; band < stripHeight_ / 8; band++) {
+            for (uint32_t x = 0; x < mcuBlocks; x++) {
+                codeBlock(coder, buffers, 0, band * bandBlocks + m * mcuBlocks + x);
+            }
+        }
+        codeBlock(coder, buffers, 1, m);
+        codeBlock(coder, buffers, 2, m);
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::codeBlock(Segment& segment, const StripBuffers& buffers,
+                                             int component, uint32_t index) const {
+    const int* block = &buffers.coefficients[component][size_t(index) * 64];
+    uint64_t mask = buffers.masks[component][index];
+    if (options_.optimizeHuffman) {
+        bufferBlock(segment, block, mask, component);
+    } else {
+        encodeBlock(segment.writer, block, mask, segment.prevDC[component],
+                    component ? dcChrom_ : dcLum_, component ? acChrom_ : acLum_);
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::bufferBlock(Segment& segment, const int block[64],
+                                              uint64_t mask, int component) const {
+    int table = component ? 1 : 0;
+    countBlock(block, mask, segment.prevDC[component], segment.dcFreq[table],
+               segment.acFreq[table]);
+    
+    // Quantized coefficients are at most 11 bits
+    segment.bufferedMasks.push_back(mask);
+    for (uint64_t nonzero = mask; nonzero; nonzero &= nonzero - 1) {
+        segment.bufferedValues.push_back(static_cast<int16_t>(block[countTrailingZeros(nonzero)]));
+    }
+}
+
+void JPEGEncoder::ScanlineEncoder::encodeBuffered(Segment& segment) const {
+    // Second pass: expand each block and code it with the optimized tables.
+    // encodeBlock() reads the DC and the coefficients in the mask only, so
+    // the rest of `block` is never cleared.
+    std::fill(segment.prevDC, segment.prevDC + 3, 0);
+    segment.writer.start(expectedBytes(segment.strips ? segment.strips : height_ / stripHeight_ + 1));
+    const int16_t* values = segment.bufferedValues.data();
+    int lumaBlocks = 1 << (hShift_ + vShift_);
+    int mcuBlocks = lumaBlocks + components_ - 1;
+    int position = 0; // within the MCU
+    int block[64];
+    for (size_t i = 0; i < segment.bufferedMasks.size(); i++) {
+        uint64_t mask = segment.bufferedMasks[i];
+        block[0] = 0;
+        for (uint64_t nonzero = mask; nonzero; nonzero &= nonzero - 1) {
+            block[countTrailingZeros(nonzero)] = *values++;
+        }
+        
+        int component = position < lumaBlocks ? 0 : position - lumaBlocks + 1;
+        position = position + 1 == mcuBlocks ? 0 : position + 1;
+        encodeBlock(segment.writer, block, mask, segment.prevDC[component],
+                    component ? dcChrom_ : dcLum_, component ? acChrom_ : acLum_);
+    }
+    segment.writer.flush();
+    
+    std::vector<uint64_t>().swap(segment.bufferedMasks);
+    std::vector<int16_t>().swap(segment.bufferedValues);
+}
+
+void JPEGEncoder::ScanlineEncoder::transformBand(const int16_t* samples, uint32_t stride,
+                                                const QuantTable& table, int* output,
+                                                uint64_t* masks) const {
+    uint32_t blocks = stride / 8;
+    if (options_.dct != DCTMethod::Integer) {
+        transformBlocksFloat(samples, stride, blocks, table, options_.pruneDCT, output, masks);
+        return;
+    }
+    
+    for (uint32_t b = 0; b < blocks; b++, samples += 8, output += 64, masks++) {
+        int32_t block[64];
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < 8; x++) {
+                block[y * 8 + x] = samples[size_t(y) * stride + x];
+            }
+        }
+        forwardDCTInt(block);
+        quantizeInt(block, table, output);
+        *masks = nonzeroMask(output);
+    }
+}
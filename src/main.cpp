@@ -1,16 +1,43 @@
 #include "png_decoder.hpp"
 #include "jpeg_encoder.hpp"
+#include "batch.hpp"
 #include <iostream>
 #include <string>
+#include <vector>
 #include <cstring>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
 
 void printUsage(const char* programName) {
     std::cout << "PNG to JPEG Converter (No External Dependencies)\n";
     std::cout << "================================================\n\n";
-    std::cout << "Usage: " << programName << " [options] <input. png> [output.jpg]\n\n";
+    std::cout << "Usage: " << programName << " [options] <input. png> [output.jpg]\n";
+    std::cout << "       '-' reads the PNG from stdin or writes the JPEG to stdout\n";
+    std::cout << "       " << programName << " --batch [options] <input.png|directory|->...\n\n";
     std::cout << "Options:\n";
     std::cout << "  -q, --quality <1-100>  Set JPEG quality (default: 85)\n";
     std::cout << "  -v, --verbose          Enable verbose output\n";
+    std::cout << "  --stats                Report peak memory use\n";
+    std::cout << "  --dct <float|int>      Forward DCT: fast float or bit-exact integer\n";
+    std::cout << "  --subsampling <mode>   Chroma subsampling: 444, 422 or 420 (default: 420)\n";
+    std::cout << "  --grayscale            Write a single-component grayscale JPEG\n";
+    std::cout << "  --prune-dct            Skip DCT work on smooth blocks (faster at low quality)\n";
+    std::cout << "  --optimize-huffman     Build Huffman tables for the image (smaller, slower)\n";
+    std::cout << "  --parallel-inflate     Decompress large PNGs on all cores\n";
+    std::cout << "  --restart <rows>       Restart marker every <rows> MCU rows\n";
+    std::cout << "  -j, --threads <n>      Encoder and inflate threads (0 = all cores)\n";
+    std::cout << "\nBatch mode:\n";
+    std::cout << "  --batch                Convert every input (files, the PNGs in directories,\n";
+    std::cout << "                         '-' for a list on stdin), -j of them at a time\n";
+    std::cout << "  -o, --output-dir <dir> Write the JPEGs into <dir>\n";
+    std::cout << "  --name <template>      Output path; {dir} and {name} are the input's\n";
+    std::cout << "                         directory and name without extension\n";
+    std::cout << "  -0, --null             The stdin list is NUL-separated, not one per line\n";
+    std::cout << "  --mem-budget <size>    Only run as many conversions at once as fit in\n";
+    std::cout << "                         <size> bytes (K, M or G suffix) by estimate\n";
     std::cout << "  -h, --help             Show this help message\n";
     std::cout << "  --version              Show version information\n\n";
     std::cout << "Examples:\n";
@@ -18,6 +45,10 @@ void printUsage(const char* programName) {
     std::cout << "  " << programName << " image.png output.jpg\n";
     std::cout << "  " << programName << " -q 90 image.png\n";
     std::cout << "  " << programName << " --quality 75 --verbose image.png converted.jpg\n";
+    std::cout << "  cat image.png | " << programName << " - - > image.jpg\n";
+    std::cout << "  " << programName << " --batch -j 8 -o jpegs/ photos/\n";
+    std::cout << "  find . -name '*.png' -print0 | " << programName << " --batch -0 -\n";
+    std::cout << "  " << programName << " --batch --mem-budget 2G -o jpegs/ scans/\n";
 }
 
 void printVersion() {
@@ -26,7 +57,59 @@ void printVersion() {
     std::cout << "No external libraries or dependencies\n";
 }
 
+// Peak resident set size of the process in bytes, 0 where unknown
+uint64_t peakResidentBytes() {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return uint64_t(usage.ru_maxrss);
+#else
+        return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// A byte count with an optional K, M or G (binary) suffix
+bool parseSize(const std::string& text, size_t& size) {
+    size_t end = 0;
+    unsigned long long value;
+    try {
+        value = std::stoull(text, &end);
+    } catch (...) {
+        return false;
+    }
+    if (text[0] == '-') {
+        return false;
+    }
+    
+    int shift = 0;
+    if (end < text.size()) {
+        switch (text[end]) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+            default: return false;
+        }
+        // Also accept KB, KiB and the like
+        std::string unit = text.substr(end + 1);
+        if (unit != "" && unit != "B" && unit != "iB") {
+            return false;
+        }
+    }
+    if (value > (SIZE_MAX >> shift)) {
+        return false;
+    }
+    size = size_t(value) << shift;
+    return true;
+}
+
 std::string getOutputFilename(const std::string& input) {
+    if (input == "-") {
+        return "-";
+    }
     size_t dotPos = input.rfind('.');
     if (dotPos != std::string::npos) {
         return input.substr(0, dotPos) + ".jpg";
@@ -34,11 +117,46 @@ std::string getOutputFilename(const std::string& input) {
     return input + ".jpg";
 }
 
+int runBatch(const std::vector<std::string>& arguments, const BatchOptions& options,
+             char listSeparator, bool stats) {
+    try {
+        // '-' stands for the list of names on stdin
+        std::vector<std::string> names;
+        for (const std::string& argument : arguments) {
+            if (argument == "-") {
+                std::vector<std::string> list = BatchConverter::readList(std::cin, listSeparator);
+                names.insert(names.end(), list.begin(), list.end());
+            } else {
+                names.push_back(argument);
+            }
+        }
+        std::vector<std::string> inputs = BatchConverter::expandInputs(names);
+        if (inputs.empty()) {
+            std::cerr << "Error: No input files for --batch\n";
+            return 1;
+        }
+        
+        BatchResult result = BatchConverter::run(inputs, options, std::cout, std::cerr);
+        BatchConverter::printSummary(result, std::cout);
+        if (stats) {
+            std::cout << "Peak RSS:    " << (peakResidentBytes() + 1023) / 1024 << " KiB\n";
+        }
+        return result.failures.empty() ? 0 : 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
+
 int main(int argc, char* argv[]) {
-    int quality = 85;
+    JPEGEncodeOptions encodeOptions;
     bool verbose = false;
-    std::string inputFile;
-    std::string outputFile;
+    bool stats = false;
+    PNGDecodeOptions decodeOptions;
+    std::vector<std::string> paths;
+    bool batch = false;
+    BatchOptions batchOptions;
+    char listSeparator = '\n';
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -52,11 +170,35 @@ int main(int argc, char* argv[]) {
             return 0;
         } else if (arg == "-v" || arg == "--verbose") {
             verbose = true;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "-0" || arg == "--null") {
+            listSeparator = '\0';
+        } else if (arg == "-o" || arg == "--output-dir" || arg == "--name") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: " << arg << " requires a value\n";
+                return 1;
+            }
+            if (arg == "--name") {
+                batchOptions.nameTemplate = argv[++i];
+            } else {
+                batchOptions.outputDir = argv[++i];
+            }
+        } else if (arg == "--mem-budget") {
+            if (i + 1 >= argc || !parseSize(argv[++i], batchOptions.memoryBudget) ||
+                batchOptions.memoryBudget == 0) {
+                std::cerr << "Error: --mem-budget requires a size, e.g. 512M or 4G\n";
+                return 1;
+            }
+        } else if (arg == "--parallel-inflate") {
+            decodeOptions.parallelInflate = true;
         } else if (arg == "-q" || arg == "--quality") {
             if (i + 1 < argc) {
                 try {
-                    quality = std::stoi(argv[++i]);
-                    if (quality < 1 || quality > 100) {
+                    encodeOptions.quality = std::stoi(argv[++i]);
+                    if (encodeOptions.quality < 1 || encodeOptions.quality > 100) {
                         std::cerr << "Error: Quality must be between 1 and 100\n";
                         return 1;
                     }
@@ -68,54 +210,110 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Error: -q/--quality requires a value\n";
                 return 1;
             }
-        } else if (arg[0] == '-') {
+        } else if (arg == "--prune-dct") {
+            encodeOptions.pruneDCT = true;
+        } else if (arg == "--grayscale") {
+            encodeOptions.grayscale = true;
+        } else if (arg == "--optimize-huffman") {
+            encodeOptions.optimizeHuffman = true;
+        } else if (arg == "--subsampling") {
+            std::string mode = i + 1 < argc ? argv[++i] : "";
+            if (mode == "444") {
+                encodeOptions.subsampling = ChromaSubsampling::S444;
+            } else if (mode == "422") {
+                encodeOptions.subsampling = ChromaSubsampling::S422;
+            } else if (mode == "420") {
+                encodeOptions.subsampling = ChromaSubsampling::S420;
+            } else {
+                std::cerr << "Error: --subsampling must be '444', '422' or '420'\n";
+                return 1;
+            }
+        } else if (arg == "--restart" || arg == "-j" || arg == "--threads") {
+            int value = -1;
+            if (i + 1 < argc) {
+                try {
+                    value = std::stoi(argv[++i]);
+                } catch (...) {
+                    value = -1;
+                }
+            }
+            if (value < 0) {
+                std::cerr << "Error: " << arg << " requires a non-negative number\n";
+                return 1;
+            }
+            if (arg == "--restart") {
+                encodeOptions.restartRows = value;
+            } else {
+                encodeOptions.threads = value;
+                decodeOptions.threads = value;
+                batchOptions.threads = value;
+            }
+        } else if (arg == "--dct") {
+            std::string method = i + 1 < argc ? argv[++i] : "";
+            if (method == "float") {
+                encodeOptions.dct = DCTMethod::Float;
+            } else if (method == "int") {
+                encodeOptions.dct = DCTMethod::Integer;
+            } else {
+                std::cerr << "Error: --dct must be 'float' or 'int'\n";
+                return 1;
+            }
+        } else if (arg[0] == '-' && arg != "-") {
             std::cerr << "Error: Unknown option: " << arg << "\n";
             printUsage(argv[0]);
             return 1;
         } else {
-            if (inputFile.empty()) {
-                inputFile = arg;
-            } else if (outputFile.empty()) {
-                outputFile = arg;
-            } else {
-                std::cerr << "Error: Too many arguments\n";
-                printUsage(argv[0]);
-                return 1;
-            }
+            paths.push_back(arg);
         }
     }
     
-    if (inputFile.empty()) {
+    if (batch) {
+        batchOptions.encode = encodeOptions;
+        batchOptions.decode = decodeOptions;
+        batchOptions.verbose = verbose;
+        return runBatch(paths, batchOptions, listSeparator, stats);
+    }
+    
+    if (paths.empty()) {
         std::cerr << "Error: No input file specified\n";
         printUsage(argv[0]);
         return 1;
     }
+    if (paths.size() > 2) {
+        std::cerr << "Error: Too many arguments\n";
+        printUsage(argv[0]);
+        return 1;
+    }
+    std::string inputFile = paths[0];
+    std::string outputFile = paths.size() > 1 ? paths[1] : "";
     
     if (outputFile.empty()) {
         outputFile = getOutputFilename(inputFile);
     }
     
+    // Messages must not mix with a JPEG going to stdout
+    std::ostream& log = outputFile == "-" ? std::cerr : std::cout;
+    
     try {
         if (verbose) {
-            std::cout << "Input file:  " << inputFile << "\n";
-            std::cout << "Output file: " << outputFile << "\n";
-            std::cout << "Quality:     " << quality << "\n";
-            std::cout << "\nDecoding PNG.. .\n";
+            log << "Input file:  " << inputFile << "\n";
+            log << "Output file: " << outputFile << "\n";
+            log << "Quality:     " << encodeOptions.quality << "\n";
+            log << "\nConverting...\n";
         }
         
-        Image image = PNGDecoder::decode(inputFile);
+        // Rows go straight from the PNG unfilter to the JPEG strip encoder
+        JPEGEncoder::ScanlineEncoder encoder(outputFile, encodeOptions);
+        PNGDecoder::decode(inputFile, encoder, decodeOptions);
         
         if (verbose) {
-            std::cout << "Image size:  " << image.width() << "x" << image.height() << "\n";
-            std::cout << "Encoding JPEG...\n";
+            log << "Image size:  " << encoder.width() << "x" << encoder.height() << "\n";
+            log << "Done!\n";
+        } else if (outputFile != "-") {
+            log << "Converted " << inputFile << " -> " << outputFile << "\n";
         }
-        
-        JPEGEncoder::encode(image, outputFile, quality);
-        
-        if (verbose) {
-            std::cout << "Done!\n";
-        } else {
-            std::cout << "Converted " << inputFile << " -> " << outputFile << "\n";
+        if (stats) {
+            log << "Peak RSS:    " << (peakResidentBytes() + 1023) / 1024 << " KiB\n";
         }
         
         return 0;
@@ -0,0 +1,119 @@
+#include "mapped_file.hpp"
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PNG2JPG_HAVE_MMAP 1
+#elif defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename)
+    : data_(nullptr), size_(0), mapped_(false) {
+    if (filename == "-") {
+        readStdin();
+        return;
+    }
+    
+#ifdef PNG2JPG_HAVE_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            ::madvise(addr, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+            data_ = static_cast<const uint8_t*>(addr);
+            size_ = static_cast<size_t>(st.st_size);
+            mapped_ = true;
+        }
+    }
+    ::close(fd);
+    
+    if (mapped_) return;
+#endif
+    readAll(filename);
+}
+
+MappedFile::~MappedFile() {
+#ifdef PNG2JPG_HAVE_MMAP
+    if (mapped_) {
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+#endif
+}
+
+void MappedFile::release(const uint8_t* begin, const uint8_t* end) {
+#ifdef PNG2JPG_HAVE_MMAP
+    if (!mapped_ || begin < data_ || end > data_ + size_) {
+        return;
+    }
+    // The mapping starts on a page boundary
+    size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t first = (static_cast<size_t>(begin - data_) + pageSize - 1) / pageSize * pageSize;
+    size_t last = static_cast<size_t>(end - data_) / pageSize * pageSize;
+    if (first < last) {
+        ::madvise(const_cast<uint8_t*>(data_) + first, last - first, MADV_DONTNEED);
+    }
+#else
+    (void)begin;
+    (void)end;
+#endif
+}
+
+void MappedFile::readStdin() {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    // A pipe has no size to go by; grow as the data comes
+    const size_t step = 64 * 1024;
+    size_t size = 0;
+    while (true) {
+        buffer_.resize(size + step);
+        size_t n = std::fread(buffer_.data() + size, 1, step, stdin);
+        size += n;
+        if (n < step) {
+            break;
+        }
+    }
+    if (std::ferror(stdin)) {
+        throw std::runtime_error("Cannot read standard input");
+    }
+    buffer_.resize(size);
+    
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+void MappedFile::readAll(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    
+    file.seekg(0, std::ios::end);
+    std::streamoff length = file.tellg();
+    if (length > 0) {
+        // Regular file: one read of the known size
+        buffer_.resize(static_cast<size_t>(length));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(buffer_.data()), length);
+        buffer_.resize(static_cast<size_t>(file.gcount()));
+    } else {
+        // Not seekable (pipe, device); read until EOF
+        file.clear();
+        buffer_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
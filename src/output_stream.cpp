@@ -0,0 +1,160 @@
+#include "output_stream.hpp"
+#include <atomic>
+#include <cerrno>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PNG2JPG_HAVE_POSIX_IO 1
+#elif defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+OutputStream::OutputStream(const std::string& filename)
+    : filename_(filename), fd_(-1), file_(nullptr), isStdout_(filename == "-"),
+      buffer_(kBufferSize), used_(0) {
+    // The output may be the very file being decoded, still mapped, so it is
+    // written next to the target under a name of its own and only renamed
+    // over it once complete. Devices, pipes and symlinks are written to
+    // directly, as renaming would replace them rather than write to them.
+    static std::atomic<unsigned> counter(0);
+#ifdef PNG2JPG_HAVE_POSIX_IO
+    if (isStdout_) {
+        fd_ = STDOUT_FILENO;
+        return;
+    }
+    struct stat target;
+    bool exists = ::lstat(filename.c_str(), &target) == 0;
+    if (exists && !S_ISREG(target.st_mode)) {
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    } else {
+        do {
+            tempName_ = filename + ".tmp" + std::to_string(::getpid()) + "-" +
+                        std::to_string(counter++);
+            fd_ = ::open(tempName_.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        } while (fd_ < 0 && errno == EEXIST);
+        // A replaced file keeps its permissions, as it would when truncated
+        if (fd_ >= 0 && exists) {
+            ::fchmod(fd_, target.st_mode & 07777);
+        }
+    }
+    if (fd_ < 0) {
+        tempName_.clear();
+        throw std::runtime_error("Cannot create output file: " + filename);
+    }
+#else
+#ifdef _WIN32
+    if (isStdout_) {
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+    if (isStdout_) {
+        file_ = stdout;
+        return;
+    }
+    tempName_ = filename + ".tmp" + std::to_string(counter++);
+    file_ = std::fopen(tempName_.c_str(), "wb");
+    if (!file_) {
+        tempName_.clear();
+        throw std::runtime_error("Cannot create output file: " + filename);
+    }
+#endif
+}
+
+OutputStream::~OutputStream() {
+    // Standard output is left as it is
+    if (isStdout_) {
+        return;
+    }
+#ifdef PNG2JPG_HAVE_POSIX_IO
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+#else
+    if (file_) {
+        std::fclose(file_);
+    }
+#endif
+    if (!tempName_.empty()) {
+        std::remove(tempName_.c_str());
+    }
+}
+
+void OutputStream::flush() {
+    writeAll(buffer_.data(), used_);
+    used_ = 0;
+}
+
+void OutputStream::close() {
+    flush();
+    if (isStdout_) {
+#ifndef PNG2JPG_HAVE_POSIX_IO
+        if (std::fflush(file_) != 0) {
+            throw std::runtime_error("Cannot write output file: " + filename_);
+        }
+#endif
+        return;
+    }
+#ifdef PNG2JPG_HAVE_POSIX_IO
+    int result = ::close(fd_);
+    fd_ = -1;
+#else
+    int result = std::fclose(file_);
+    file_ = nullptr;
+#endif
+    if (result != 0) {
+        throw std::runtime_error("Cannot write output file: " + filename_);
+    }
+    
+    if (!tempName_.empty()) {
+#ifndef PNG2JPG_HAVE_POSIX_IO
+        // rename() does not replace an existing file everywhere
+        std::remove(filename_.c_str());
+#endif
+        if (std::rename(tempName_.c_str(), filename_.c_str()) != 0) {
+            throw std::runtime_error("Cannot write output file: " + filename_);
+        }
+        tempName_.clear();
+    }
+}
+
+void OutputStream::writeSlow(const uint8_t* data, size_t size) {
+    // Top the buffer up and send it, then send whole buffers' worth straight
+    // from `data`
+    size_t n = buffer_.size() - used_;
+    std::memcpy(buffer_.data() + used_, data, n);
+    used_ += n;
+    flush();
+    data += n;
+    size -= n;
+    if (size >= buffer_.size()) {
+        writeAll(data, size);
+    } else {
+        std::memcpy(buffer_.data(), data, size);
+        used_ = size;
+    }
+}
+
+void OutputStream::writeAll(const uint8_t* data, size_t size) {
+#ifdef PNG2JPG_HAVE_POSIX_IO
+    // Pipes and sockets may take less than asked for
+    while (size > 0) {
+        ssize_t n = ::write(fd_, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Cannot write output file: " + filename_);
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+#else
+    if (size > 0 && std::fwrite(data, 1, size, file_) != size) {
+        throw std::runtime_error("Cannot write output file: " + filename_);
+    }
+#endif
+}
@@ -1,118 +1,346 @@
 #include "png_decoder.hpp"
-#include "deflate.hpp"
-#include <fstream>
+#include "mapped_file.hpp"
 #include <stdexcept>
 #include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PNG2JPG_SSE2 1
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 uint32_t PNGDecoder::readBigEndian32(const uint8_t* data) {
     return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
 }
 
-bool PNGDecoder::verifySignature(const std::vector<uint8_t>& data) {
+bool PNGDecoder::verifySignature(const uint8_t* data, size_t size) {
     static const uint8_t signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
-    if (data.size() < 8) return false;
-    return std::memcmp(data.data(), signature, 8) == 0;
+    if (size < 8) return false;
+    return std::memcmp(data, signature, 8) == 0;
 }
 
-PNGDecoder::PNGHeader PNGDecoder::parseIHDR(const std::vector<uint8_t>& data, size_t offset) {
+PNGDecoder::PNGHeader PNGDecoder::parseIHDR(const uint8_t* data, size_t size) {
+    // IHDR must be the first chunk: 8 (sig) + 4 (len) + 4 (type) + 13 (data)
+    if (size < 8 + 8 + 13 || readBigEndian32(&data[8]) != 13 ||
+        std::memcmp(&data[12], "IHDR", 4) != 0) {
+        throw std::runtime_error("Missing IHDR chunk");
+    }
+    
+    const uint8_t* ihdr = data + 16;
     PNGHeader header;
-    header.width = readBigEndian32(&data[offset]);
-    header.height = readBigEndian32(&data[offset + 4]);
-    header.bitDepth = data[offset + 8];
-    header.colorType = data[offset + 9];
-    header.compression = data[offset + 10];
-    header.filter = data[offset + 11];
-    header.interlace = data[offset + 12];
+    header.width = readBigEndian32(&ihdr[0]);
+    header.height = readBigEndian32(&ihdr[4]);
+    header.bitDepth = ihdr[8];
+    header.colorType = ihdr[9];
+    header.compression = ihdr[10];
+    header.filter = ihdr[11];
+    header.interlace = ihdr[12];
     return header;
 }
 
-std::vector<uint8_t> PNGDecoder::extractIDATData(const std::vector<uint8_t>& data) {
-    std::vector<uint8_t> idatData;
+// Input consumed before pages of the mapped file are released
+static const size_t releaseStep = size_t(1) << 20;
+
+std::vector<Deflate::Span> PNGDecoder::findIDATChunks(const MappedFile& file) {
+    const uint8_t* data = file.data();
+    size_t size = file.size();
+    std::vector<Deflate::Span> chunks;
     size_t pos = 8; // Skip signature
     
-    while (pos + 12 <= data.size()) {
+    while (pos + 12 <= size) {
         uint32_t length = readBigEndian32(&data[pos]);
-        char type[5] = {0};
-        std::memcpy(type, &data[pos + 4], 4);
+        if (length > size - pos - 12) {
+            throw std::runtime_error("Truncated PNG chunk");
+        }
         
-        if (std::strcmp(type, "IDAT") == 0) {
-            idatData.insert(idatData. end(), 
-                           data. begin() + pos + 8, 
-                           data.begin() + pos + 8 + length);
-        } else if (std::strcmp(type, "IEND") == 0) {
+        if (std::memcmp(&data[pos + 4], "IDAT", 4) == 0) {
+            chunks.push_back({data + pos + 8, length});
+        } else if (std::memcmp(&data[pos + 4], "IEND", 4) == 0) {
             break;
         }
         
         pos += 12 + length; // length + type + data + crc
     }
     
-    return idatData;
+    return chunks;
 }
 
-uint8_t PNGDecoder::paethPredictor(int a, int b, int c) {
-    int p = a + b - c;
-    int pa = std::abs(p - a);
-    int pb = std::abs(p - b);
-    int pc = std::abs(p - c);
+static uint8_t paethPredictor(int a, int b, int c) {
+    int pa = std::abs(b - c);         // |p - a| with p = a + b - c
+    int pb = std::abs(a - c);         // |p - b|
+    int pc = std::abs(a + b - 2 * c); // |p - c|
     
     if (pa <= pb && pa <= pc) return static_cast<uint8_t>(a);
     if (pb <= pc) return static_cast<uint8_t>(b);
     return static_cast<uint8_t>(c);
 }
 
-void PNGDecoder::unfilterScanlines(std::vector<uint8_t>& rawData, uint32_t width,
-                                    uint32_t height, int bytesPerPixel) {
-    int stride = width * bytesPerPixel;
-    std::vector<uint8_t> unfiltered(height * stride);
-    std::vector<uint8_t> prevRow(stride, 0);
-    
-    size_t srcPos = 0;
-    for (uint32_t y = 0; y < height; y++) {
-        uint8_t filterType = rawData[srcPos++];
+// Scalar row kernels, one per filter type, for a pixel size known at compile
+// time. `row` is reconstructed in place; `prev` is the previous
+// reconstructed row (all zeros for the first row).
+template <int Bpp>
+static void unfilterSub(uint8_t* row, size_t rowBytes) {
+    for (size_t x = Bpp; x < rowBytes; x++) {
+        row[x] += row[x - Bpp];
+    }
+}
+
+static void unfilterUp(uint8_t* row, const uint8_t* prev, size_t rowBytes) {
+    size_t x = 0;
+#ifdef __AVX2__
+    for (; x + 32 <= rowBytes; x += 32) {
+        __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + x), _mm256_add_epi8(r, b));
+    }
+#endif
+#ifdef PNG2JPG_SSE2
+    for (; x + 16 <= rowBytes; x += 16) {
+        __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), _mm_add_epi8(r, b));
+    }
+#endif
+    for (; x < rowBytes; x++) {
+        row[x] += prev[x];
+    }
+}
+
+template <int Bpp>
+static void unfilterAverage(uint8_t* row, const uint8_t* prev, size_t rowBytes) {
+    for (int x = 0; x < Bpp; x++) {
+        row[x] += prev[x] >> 1;
+    }
+    for (size_t x = Bpp; x < rowBytes; x++) {
+        row[x] += (row[x - Bpp] + prev[x]) >> 1;
+    }
+}
+
+template <int Bpp>
+static void unfilterPaeth(uint8_t* row, const uint8_t* prev, size_t rowBytes) {
+    // With a = c = 0 the predictor is always b
+    for (int x = 0; x < Bpp; x++) {
+        row[x] += prev[x];
+    }
+    for (size_t x = Bpp; x < rowBytes; x++) {
+        row[x] += paethPredictor(row[x - Bpp], prev[x], prev[x - Bpp]);
+    }
+}
+
+#ifdef PNG2JPG_SSE2
+// SSE2 kernels for 3- and 4-byte pixels (RGB, RGBA). Sub, Average and Paeth
+// depend on the pixel to the left, so these work one pixel per step with all
+// channels in one register; the win over the scalar code is doing the
+// channels together and the branch-free Paeth selection.
+template <int Bpp>
+static __m128i loadPixel(const uint8_t* p) {
+    int32_t value = 0;
+    std::memcpy(&value, p, Bpp);
+    return _mm_cvtsi32_si128(value);
+}
+
+template <int Bpp>
+static void storePixel(uint8_t* p, __m128i v) {
+    int32_t value = _mm_cvtsi128_si32(v);
+    std::memcpy(p, &value, Bpp);
+}
+
+template <int Bpp>
+static void unfilterSubSSE2(uint8_t* row, size_t rowBytes) {
+    __m128i a = _mm_setzero_si128();
+    for (size_t x = 0; x < rowBytes; x += Bpp) {
+        a = _mm_add_epi8(a, loadPixel<Bpp>(row + x));
+        storePixel<Bpp>(row + x, a);
+    }
+}
+
+template <int Bpp>
+static void unfilterAverageSSE2(uint8_t* row, const uint8_t* prev, size_t rowBytes) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (size_t x = 0; x < rowBytes; x += Bpp) {
+        __m128i b = loadPixel<Bpp>(prev + x);
+        // _mm_avg_epu8 rounds up; PNG wants floor((a + b) / 2)
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(loadPixel<Bpp>(row + x), avg);
+        storePixel<Bpp>(row + x, a);
+    }
+}
+
+static __m128i abs16(__m128i v) {
+    return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+static __m128i select16(__m128i mask, __m128i ifTrue, __m128i ifFalse) {
+    return _mm_or_si128(_mm_and_si128(mask, ifTrue), _mm_andnot_si128(mask, ifFalse));
+}
+
+template <int Bpp>
+static void unfilterPaethSSE2(uint8_t* row, const uint8_t* prev, size_t rowBytes) {
+    // a, b, c widened to 16 bits so the predictor distances cannot overflow
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    for (size_t x = 0; x < rowBytes; x += Bpp) {
+        __m128i b = _mm_unpacklo_epi8(loadPixel<Bpp>(prev + x), zero);
+        
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = abs16(_mm_add_epi16(pa, pb));
+        pa = abs16(pa);
+        pb = abs16(pb);
+        
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i nearest = select16(_mm_cmpeq_epi16(pa, smallest), a,
+                                   select16(_mm_cmpeq_epi16(pb, smallest), b, c));
         
-        for (int x = 0; x < stride; x++) {
-            uint8_t raw = rawData[srcPos++];
-            uint8_t a = (x >= bytesPerPixel) ? unfiltered[y * stride + x - bytesPerPixel] : 0;
-            uint8_t b = prevRow[x];
-            uint8_t c = (x >= bytesPerPixel) ? prevRow[x - bytesPerPixel] : 0;
-            
-            uint8_t result;
-            switch (filterType) {
-                case 0: result = raw; break;
-                case 1: result = raw + a; break;
-                case 2: result = raw + b; break;
-                case 3: result = raw + ((a + b) / 2); break;
-                case 4: result = raw + paethPredictor(a, b, c); break;
-                default: throw std::runtime_error("Unknown filter type");
+        __m128i d = _mm_add_epi8(loadPixel<Bpp>(row + x), _mm_packus_epi16(nearest, nearest));
+        storePixel<Bpp>(row + x, d);
+        
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    }
+}
+#endif
+
+template <int Bpp>
+void PNGDecoder::unfilterRow(uint8_t filterType, uint8_t* row, const uint8_t* prev, size_t rowBytes) {
+    switch (filterType) {
+        case 0:
+            break;
+        case 1:
+#ifdef PNG2JPG_SSE2
+            if constexpr (Bpp == 3 || Bpp == 4) {
+                unfilterSubSSE2<Bpp>(row, rowBytes);
+                break;
+            }
+#endif
+            unfilterSub<Bpp>(row, rowBytes);
+            break;
+        case 2:
+            unfilterUp(row, prev, rowBytes);
+            break;
+        case 3:
+#ifdef PNG2JPG_SSE2
+            if constexpr (Bpp == 3 || Bpp == 4) {
+                unfilterAverageSSE2<Bpp>(row, prev, rowBytes);
+                break;
+            }
+#endif
+            unfilterAverage<Bpp>(row, prev, rowBytes);
+            break;
+        case 4:
+#ifdef PNG2JPG_SSE2
+            if constexpr (Bpp == 3 || Bpp == 4) {
+                unfilterPaethSSE2<Bpp>(row, prev, rowBytes);
+                break;
+            }
+#endif
+            unfilterPaeth<Bpp>(row, prev, rowBytes);
+            break;
+        default:
+            throw std::runtime_error("Unknown filter type");
+    }
+}
+
+const PNGDecoder::FormatHandler* PNGDecoder::findFormat(uint8_t colorType, uint8_t bitDepth) {
+    static const FormatHandler handlers[] = {
+        {0, 8, 1, 1, &unfilterRow<1>}, // Grayscale
+        {2, 8, 3, 3, &unfilterRow<3>}, // RGB
+        {4, 8, 2, 2, &unfilterRow<2>}, // Grayscale + Alpha
+        {6, 8, 4, 4, &unfilterRow<4>}, // RGBA
+    };
+    for (const FormatHandler& handler : handlers) {
+        if (handler.colorType == colorType && handler.bitDepth == bitDepth) {
+            return &handler;
+        }
+    }
+    return nullptr;
+}
+
+// Collects the decoded rows into an RGB Image; alpha, if any, is the last
+// channel and is dropped
+class ImageSink : public ScanlineSink {
+public:
+    explicit ImageSink(Image& image) : image_(image), convert_(nullptr) {}
+    
+    void begin(const ScanlineFormat& format) override {
+        // Gray stays a single plane; alpha is dropped
+        image_.resize(format.width, format.height, format.channels >= 3 ? 3 : 1);
+        switch (format.channels) {
+            case 1: convert_ = &convertRow<1>; break;
+            case 2: convert_ = &convertRow<2>; break;
+            case 3: convert_ = &convertRow<3>; break;
+            case 4: convert_ = &convertRow<4>; break;
+            default: throw std::runtime_error("Unsupported channel count");
+        }
+    }
+    
+    void row(uint32_t y, const uint8_t* samples) override {
+        convert_(samples, image_, y);
+    }
+    
+private:
+    template <int Channels>
+    static void convertRow(const uint8_t* src, Image& image, uint32_t y) {
+        if constexpr (Channels >= 3) {
+            uint8_t* r = image.row(0, y);
+            uint8_t* g = image.row(1, y);
+            uint8_t* b = image.row(2, y);
+            for (uint32_t x = 0; x < image.width(); x++, src += Channels) {
+                r[x] = src[0];
+                g[x] = src[1];
+                b[x] = src[2];
+            }
+        } else {
+            uint8_t* gray = image.row(0, y);
+            for (uint32_t x = 0; x < image.width(); x++, src += Channels) {
+                gray[x] = src[0];
             }
-            
-            unfiltered[y * stride + x] = result;
         }
-        
-        std::copy(unfiltered.begin() + y * stride,
-                 unfiltered.begin() + (y + 1) * stride,
-                 prevRow.begin());
     }
     
-    rawData = std::move(unfiltered);
+    Image& image_;
+    void (*convert_)(const uint8_t* src, Image& image, uint32_t y);
+};
+
+Image PNGDecoder::decode(const std::string& filename, const PNGDecodeOptions& options) {
+    Image image;
+    ImageSink sink(image);
+    decode(filename, sink, options);
+    return image;
+}
+
+void PNGDecoder::decode(const std::string& filename, ScanlineSink& sink,
+                        const PNGDecodeOptions& options) {
+    MappedFile file(filename);
+    decode(file, sink, options);
 }
 
-Image PNGDecoder::decode(const std::string& filename) {
+PNGDecoder::PNGHeader PNGDecoder::readHeader(const std::string& filename) {
+    // Signature, IHDR length and type, IHDR data
+    uint8_t data[8 + 8 + 13];
     std::ifstream file(filename, std::ios::binary);
     if (!file) {
         throw std::runtime_error("Cannot open file: " + filename);
     }
+    file.read(reinterpret_cast<char*>(data), sizeof(data));
+    size_t size = static_cast<size_t>(file.gcount());
     
-    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
-                               std::istreambuf_iterator<char>());
-    
-    if (!verifySignature(data)) {
+    if (!verifySignature(data, size)) {
         throw std::runtime_error("Invalid PNG signature");
     }
-    
-    // Parse IHDR
-    PNGHeader header = parseIHDR(data, 16); // 8 (sig) + 4 (len) + 4 (type)
-    
+    return parseIHDR(data, size);
+}
+
+const PNGDecoder::FormatHandler* PNGDecoder::checkHeader(const PNGHeader& header) {
     if (header.interlace != 0) {
         throw std::runtime_error("Interlaced PNGs not supported");
     }
@@ -121,50 +349,105 @@ Image PNGDecoder::decode(const std::string& filename) {
         throw std::runtime_error("Only 8-bit depth supported");
     }
     
-    int bytesPerPixel;
-    switch (header.colorType) {
-        case 0: bytesPerPixel = 1; break; // Grayscale
-        case 2: bytesPerPixel = 3; break; // RGB
-        case 4: bytesPerPixel = 2; break; // Grayscale + Alpha
-        case 6: bytesPerPixel = 4; break; // RGBA
-        default: throw std::runtime_error("Unsupported color type");
+    const FormatHandler* format = findFormat(header.colorType, header.bitDepth);
+    if (!format) {
+        throw std::runtime_error("Unsupported color type");
+    }
+    
+    uint64_t rawSize = uint64_t(header.height) * (1 + uint64_t(header.width) * format->bytesPerPixel);
+    if (header.width == 0 || header.height == 0 || rawSize > SIZE_MAX) {
+        throw std::runtime_error("Invalid image dimensions");
+    }
+    return format;
+}
+
+ScanlineFormat PNGDecoder::scanlineFormat(const PNGHeader& header) {
+    return {header.width, header.height, checkHeader(header)->channels};
+}
+
+size_t PNGDecoder::workingSetBytes(const PNGHeader& header, uint64_t fileSize,
+                                   const PNGDecodeOptions& options) {
+    const FormatHandler* format = checkHeader(header);
+    size_t rowBytes = size_t(header.width) * format->bytesPerPixel;
+    
+    // Streaming: the two scanlines and the zero row, the inflate buffer, and
+    // the input, which the chunk walk can fault in whole before the inflate
+    // releases it
+    size_t bytes = 3 * (rowBytes + 1) + (size_t(128) << 10) + static_cast<size_t>(fileSize);
+    if (options.parallelInflate) {
+        // The whole inflated image, and on more than one thread the 16-bit
+        // symbols every chunk decodes into before they are resolved
+        size_t rawSize = size_t(header.height) * (rowBytes + 1);
+        unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+        bytes += rawSize * (threads > 1 ? 3 : 1);
+    }
+    return bytes;
+}
+
+void PNGDecoder::decode(MappedFile& file, ScanlineSink& sink, const PNGDecodeOptions& options) {
+    if (!verifySignature(file.data(), file.size())) {
+        throw std::runtime_error("Invalid PNG signature");
     }
     
-    // Extract and decompress IDAT chunks
-    std::vector<uint8_t> compressedData = extractIDATData(data);
-    std::vector<uint8_t> rawData = Deflate::decompress(compressedData);
+    PNGHeader header = parseIHDR(file.data(), file.size());
+    const FormatHandler* format = checkHeader(header);
+    size_t rowBytes = size_t(header.width) * format->bytesPerPixel;
+    
+    // Each scanline is a filter byte followed by width * bytesPerPixel
+    // bytes, so the inflated size is known before decompressing
+    uint64_t rawSize = uint64_t(header.height) * (1 + uint64_t(rowBytes));
+    
+    // Deflate expands by at most 1032:1, so IHDR cannot claim more than
+    // that over the IDAT data, and the sink gets to reject the dimensions
+    // before any buffer is sized from them
+    std::vector<Deflate::Span> idat = findIDATChunks(file);
+    uint64_t idatSize = 0;
+    for (const Deflate::Span& span : idat) {
+        idatSize += span.size;
+    }
+    if (rawSize > idatSize * 1032) {
+        throw std::runtime_error("Decompressed data too short");
+    }
+    sink.begin({header.width, header.height, format->channels});
     
-    // Unfilter
-    unfilterScanlines(rawData, header.width, header.height, bytesPerPixel);
+    // Scanlines are inflated one at a time into two alternating lines, and
+    // the input is let go of as it is consumed; the parallel inflate needs
+    // the whole output buffer and decodes it up front
+    std::unique_ptr<Deflate::Stream> stream;
+    const uint8_t* released = file.data(); // input pages let go of so far
+    std::vector<uint8_t> rawData;
+    if (options.parallelInflate) {
+        rawData.resize(static_cast<size_t>(rawSize));
+        Deflate::inflateParallel(idat, rawData.data(), rawData.size(), options.threads);
+    } else {
+        stream.reset(new Deflate::Stream(idat));
+        rawData.resize(2 * (rowBytes + 1));
+    }
     
-    // Convert to Image
-    Image image(header.width, header.height);
+    // Reconstruct every scanline in place (the filter byte in front of it is
+    // left as is) against the previous one, and hand it on while it is still
+    // in cache
+    std::vector<uint8_t> zeroRow(rowBytes, 0);
+    const uint8_t* prev = zeroRow.data();
     
     for (uint32_t y = 0; y < header.height; y++) {
-        for (uint32_t x = 0; x < header.width; x++) {
-            size_t pos = (y * header.width + x) * bytesPerPixel;
-            Pixel& pixel = image.at(x, y);
-            
-            switch (header.colorType) {
-                case 0: // Grayscale
-                    pixel.r = pixel.g = pixel.b = rawData[pos];
-                    break;
-                case 2: // RGB
-                    pixel. r = rawData[pos];
-                    pixel.g = rawData[pos + 1];
-                    pixel.b = rawData[pos + 2];
-                    break;
-                case 4: // Grayscale + Alpha (ignore alpha)
-                    pixel.r = pixel.g = pixel.b = rawData[pos];
-                    break;
-                case 6: // RGBA (ignore alpha)
-                    pixel.r = rawData[pos];
-                    pixel.g = rawData[pos + 1];
-                    pixel.b = rawData[pos + 2];
-                    break;
+        uint8_t* line;
+        if (stream) {
+            line = rawData.data() + (y & 1) * (rowBytes + 1);
+            stream->read(line, rowBytes + 1);
+            if (stream->inputPosition() - released >= ptrdiff_t(releaseStep)) {
+                file.release(released, stream->inputPosition());
+                released = stream->inputPosition();
             }
+        } else {
+            line = rawData.data() + y * (rowBytes + 1);
         }
+        format->unfilter(line[0], line + 1, prev, rowBytes);
+        sink.row(y, line + 1);
+        prev = line + 1;
     }
-    
-    return image;
-}
\ No newline at end of file
+    if (stream) {
+        stream->finish();
+    }
+    sink.end();
+}
@@ -0,0 +1,111 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+    : nextQueue_(0), queued_(0), unfinished_(0), stopping_(false) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        queues_.emplace_back(new Queue());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        threads_.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        allDone_.wait(lock, [&]() { return unfinished_ == 0; });
+        stopping_ = true;
+    }
+    workAvailable_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    Queue& queue = *queues_[nextQueue_];
+    nextQueue_ = (nextQueue_ + 1) % queues_.size();
+    // Counted first, so a worker that takes the task at once never brings
+    // the counters below zero
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_++;
+        unfinished_++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    workAvailable_.notify_one();
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    allDone_.wait(lock, [&]() { return unfinished_ == 0; });
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void WorkStealingPool::workerLoop(unsigned index) {
+    while (true) {
+        std::function<void()> task;
+        if (!take(index, task)) {
+            // queued_ counts a task before it is in a deque, and until
+            // another worker's take() has counted it out; then this only
+            // goes round again
+            std::unique_lock<std::mutex> lock(mutex_);
+            workAvailable_.wait(lock, [&]() { return stopping_ || queued_ > 0; });
+            if (queued_ == 0) {
+                return;
+            }
+            continue;
+        }
+        
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        task = nullptr;
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error && !error_) {
+            error_ = error;
+        }
+        if (--unfinished_ == 0) {
+            allDone_.notify_all();
+        }
+    }
+}
+
+bool WorkStealingPool::take(unsigned index, std::function<void()>& task) {
+    // Own tasks first, oldest first; then the newest of another worker's
+    for (size_t i = 0; i < queues_.size() && !task; i++) {
+        Queue& queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_--;
+    return true;
+}
@@ -0,0 +1,127 @@
+// Checks both forward DCTs, with the output scaling folded into the
+// quantization tables, against the textbook cosine-sum transform they
+// replaced
+#include "jpeg_encoder.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+class DCTTest {
+public:
+    static int run();
+    
+private:
+    static const int kBlocks = 20000;
+    // Largest coefficient error allowed, in orthonormal DCT units
+    static constexpr double kFloatBound = 1e-3;
+    static constexpr double kIntBound = 0.5;
+    
+    static void referenceDCT(const int16_t samples[64], double output[64]);
+    static void randomBlock(std::mt19937& rng, int pattern, int16_t samples[64]);
+    static bool check(const char* name, double error, double bound);
+};
+
+// The O(n^4) definition from ITU T.81 A.3.3, in natural order
+void DCTTest::referenceDCT(const int16_t samples[64], double output[64]) {
+    const double pi = std::acos(-1.0);
+    for (int u = 0; u < 8; u++) {
+        for (int v = 0; v < 8; v++) {
+            double sum = 0.0;
+            for (int x = 0; x < 8; x++) {
+                for (int y = 0; y < 8; y++) {
+                    sum += samples[x * 8 + y] * std::cos((2 * x + 1) * u * pi / 16) *
+                           std::cos((2 * y + 1) * v * pi / 16);
+                }
+            }
+            double cu = u ? 1.0 : std::sqrt(0.5);
+            double cv = v ? 1.0 : std::sqrt(0.5);
+            output[u * 8 + v] = 0.25 * cu * cv * sum;
+        }
+    }
+}
+
+// Level-shifted samples: uniform noise, full-range extremes, or a smooth
+// ramp with a little noise
+void DCTTest::randomBlock(std::mt19937& rng, int pattern, int16_t samples[64]) {
+    std::uniform_int_distribution<int> sample(-128, 127);
+    int base = sample(rng);
+    for (int i = 0; i < 64; i++) {
+        switch (pattern) {
+            case 0: samples[i] = static_cast<int16_t>(sample(rng)); break;
+            case 1: samples[i] = sample(rng) < 0 ? -128 : 127; break;
+            default:
+                samples[i] = static_cast<int16_t>(std::max(-128, std::min(127,
+                                 base + (i / 8 + i % 8) * 3 + sample(rng) / 32)));
+                break;
+        }
+    }
+}
+
+bool DCTTest::check(const char* name, double error, double bound) {
+    bool ok = error <= bound;
+    std::printf("%-28s max error %.5f (bound %.4g) %s\n", name, error, bound, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int DCTTest::run() {
+    std::mt19937 rng(12345);
+    const int qualities[] = {100, 85, 50, 10};
+    double floatError = 0, intError = 0, floatQuantError = 0, intQuantError = 0;
+    
+    for (int b = 0; b < kBlocks; b++) {
+        int16_t samples[64];
+        randomBlock(rng, b % 3, samples);
+        double reference[64];
+        referenceDCT(samples, reference);
+        
+        JPEGEncoder::QuantTable table;
+        int quality = qualities[b % 4];
+        JPEGEncoder::buildQuantTable(b & 4 ? JPEGEncoder::chrominanceQuantTable
+                                           : JPEGEncoder::luminanceQuantTable,
+                                     quality, table);
+        
+        // Raw transforms, unscaled with the table's own factors: the float
+        // output times reciprocal is coefficient / q, the integer output
+        // over divisor likewise
+        float floatBlock[64];
+        int32_t intBlock[64];
+        for (int i = 0; i < 64; i++) {
+            floatBlock[i] = samples[i];
+            intBlock[i] = samples[i];
+        }
+        JPEGEncoder::forwardDCTFloat(floatBlock);
+        JPEGEncoder::forwardDCTInt(intBlock);
+        for (int i = 0; i < 64; i++) {
+            double q = table.values[i];
+            floatError = std::max(floatError,
+                                  std::fabs(floatBlock[i] * table.reciprocals[i] * q - reference[i]));
+            intError = std::max(intError,
+                                std::fabs(double(intBlock[i]) / table.divisors[i] * q - reference[i]));
+        }
+        
+        // Quantized output of the paths the encoder runs, in zigzag order;
+        // each may be off by the rounding plus its transform error
+        int floatOutput[64], intOutput[64];
+        uint64_t mask;
+        JPEGEncoder::transformBlocksFloat(samples, 8, 1, table, false, floatOutput, &mask);
+        JPEGEncoder::quantizeInt(intBlock, table, intOutput);
+        for (int i = 0; i < 64; i++) {
+            int natural = JPEGEncoder::ZIGZAG[i];
+            double exact = reference[natural] / table.values[natural];
+            floatQuantError = std::max(floatQuantError, std::fabs(floatOutput[i] - exact));
+            intQuantError = std::max(intQuantError, std::fabs(intOutput[i] - exact));
+        }
+    }
+    
+    bool ok = check("forwardDCTFloat", floatError, kFloatBound);
+    ok &= check("forwardDCTInt", intError, kIntBound);
+    // The quantized errors are in quantizer steps, q >= 1
+    ok &= check("transformBlocksFloat", floatQuantError, 0.5 + kFloatBound);
+    ok &= check("forwardDCTInt + quantizeInt", intQuantError, 0.5 + kIntBound);
+    return ok ? 0 : 1;
+}
+
+int main() {
+    return DCTTest::run();
+}
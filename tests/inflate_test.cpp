@@ -0,0 +1,494 @@
+// Checks the speculative parallel inflate against the serial one, byte for
+// byte, on zlib streams built here: stored, fixed-Huffman, RLE-only and
+// dynamic-Huffman blocks, split over many spans and cut into chunks small
+// enough that some speculative guesses are taken and others are decoded
+// again from the real boundary. Stored blocks carrying deflate data of
+// their own, which runs into the real block after them, plant block headers
+// the search takes but stitching has to reject.
+#include "deflate.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class InflateTest {
+public:
+    static int run();
+    
+private:
+    enum class Mode { Stored, Fixed, RLE, Dynamic, Mixed, Nested };
+    
+    // A literal when length is 0, a match otherwise
+    struct Token {
+        uint16_t length;
+        uint16_t distance;
+        uint8_t literal;
+    };
+    
+    // LSB-first, as deflate packs its bits
+    class BitWriter {
+    public:
+        void writeBits(uint32_t bits, int count) {
+            for (int i = 0; i < count; i++) {
+                if (bitCount_ == 0) {
+                    bytes.push_back(0);
+                }
+                bytes.back() |= static_cast<uint8_t>(((bits >> i) & 1) << bitCount_);
+                bitCount_ = (bitCount_ + 1) & 7;
+            }
+        }
+        void alignToByte() { bitCount_ = 0; }
+        
+        std::vector<uint8_t> bytes;
+        
+    private:
+        int bitCount_ = 0;
+    };
+    
+    // A prefix code as lengths per symbol and the codes bit-reversed, ready
+    // for writeBits()
+    struct Code {
+        std::vector<int> lengths;
+        std::vector<uint32_t> codes;
+        
+        void write(BitWriter& out, int symbol) const { out.writeBits(codes[symbol], lengths[symbol]); }
+    };
+    
+    static std::vector<uint8_t> sampleData(std::mt19937& rng, size_t size);
+    static std::vector<Token> tokenize(const std::vector<uint8_t>& data, bool rleOnly);
+    static std::vector<uint8_t> compress(const std::vector<uint8_t>& data, Mode mode,
+                                         std::mt19937& rng);
+    static std::vector<uint8_t> nestedStream(std::mt19937& rng, std::vector<uint8_t>& data);
+    static void writeStoredBlock(BitWriter& out, const uint8_t* data, size_t size);
+    static void writeTokens(BitWriter& out, const Token* tokens, size_t count, const Code& litLen,
+                            const Code& dist);
+    static void writeDynamicBlock(BitWriter& out, const Token* tokens, size_t count);
+    static Code buildCode(std::vector<uint32_t> freq, int limit);
+    static void assignCodes(Code& code);
+    static std::vector<Deflate::Span> split(const std::vector<uint8_t>& stream, std::mt19937& rng);
+};
+
+static const int kLengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                     2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int kDistBase[30] = {1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                  33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                  1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const int kDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                   6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const int kCodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static void appendAdler32(std::vector<uint8_t>& stream, const std::vector<uint8_t>& data) {
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : data) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    uint32_t adler = (b << 16) | a;
+    for (int shift = 24; shift >= 0; shift -= 8) stream.push_back(static_cast<uint8_t>(adler >> shift));
+}
+
+static int lengthSymbol(int length) {
+    int i = 28;
+    while (kLengthBase[i] > length) i--;
+    return i;
+}
+
+static int distSymbol(int distance) {
+    int i = 29;
+    while (kDistBase[i] > distance) i--;
+    return i;
+}
+
+// Random bytes, word salad, long runs and copies of earlier data from all
+// over the window, in pieces of random size
+std::vector<uint8_t> InflateTest::sampleData(std::mt19937& rng, size_t size) {
+    static const char* const words[] = {"pixel", "scanline", "filter", "deflate", "chunk",
+                                        "window", "huffman", "the", "of", "a"};
+    std::vector<uint8_t> data;
+    while (data.size() < size) {
+        size_t piece = 16 + rng() % 4096;
+        switch (rng() % 4) {
+            case 0:
+                for (size_t i = 0; i < piece; i++) data.push_back(static_cast<uint8_t>(rng()));
+                break;
+            case 1:
+                for (size_t n = 0; n < piece / 6; n++) {
+                    for (const char* c = words[rng() % 10]; *c; c++) data.push_back(*c);
+                    data.push_back(' ');
+                }
+                break;
+            case 2:
+                data.insert(data.end(), piece, static_cast<uint8_t>(rng()));
+                break;
+            default:
+                if (!data.empty()) {
+                    size_t distance = 1 + rng() % std::min<size_t>(data.size(), 32768);
+                    for (size_t i = 0; i < piece; i++) data.push_back(data[data.size() - distance]);
+                }
+                break;
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+// Greedy LZ77 over a hash chain, or with rleOnly just runs at distance 1
+std::vector<InflateTest::Token> InflateTest::tokenize(const std::vector<uint8_t>& data, bool rleOnly) {
+    std::vector<Token> tokens;
+    std::vector<int64_t> head(1 << 15, -1), prev(data.size(), -1);
+    auto hash = [&](size_t i) {
+        return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & 0x7FFF;
+    };
+    
+    size_t i = 0;
+    while (i < data.size()) {
+        size_t bestLength = 0, bestDistance = 0;
+        size_t maxLength = std::min<size_t>(258, data.size() - i);
+        if (rleOnly) {
+            if (i > 0) {
+                while (bestLength < maxLength && data[i + bestLength] == data[i - 1]) bestLength++;
+                bestDistance = 1;
+            }
+        } else if (maxLength >= 3) {
+            int64_t candidate = head[hash(i)];
+            for (int depth = 0; depth < 16 && candidate >= 0 && i - candidate <= 32768; depth++) {
+                size_t length = 0;
+                while (length < maxLength && data[candidate + length] == data[i + length]) length++;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = i - candidate;
+                }
+                candidate = prev[candidate];
+            }
+        }
+        
+        size_t step = bestLength >= 3 ? bestLength : 1;
+        if (bestLength >= 3) {
+            tokens.push_back({static_cast<uint16_t>(bestLength), static_cast<uint16_t>(bestDistance), 0});
+        } else {
+            tokens.push_back({0, 0, data[i]});
+        }
+        for (size_t j = i; j < i + step; j++) {
+            if (j + 3 <= data.size()) {
+                prev[j] = head[hash(j)];
+                head[hash(j)] = static_cast<int64_t>(j);
+            }
+        }
+        i += step;
+    }
+    return tokens;
+}
+
+// Huffman code lengths of at most `limit` bits; frequencies are flattened
+// until the tree is shallow enough. At least two symbols get a code, so the
+// code is complete.
+InflateTest::Code InflateTest::buildCode(std::vector<uint32_t> freq, int limit) {
+    size_t used = std::count_if(freq.begin(), freq.end(), [](uint32_t f) { return f > 0; });
+    for (size_t s = 0; used < 2; s++) {
+        if (freq[s] == 0) {
+            freq[s] = 1;
+            used++;
+        }
+    }
+    
+    Code code;
+    while (true) {
+        // Nodes 0..n-1 are the symbols, the rest internal
+        typedef std::pair<uint64_t, int> Node;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        std::vector<int> parent(2 * freq.size(), -1);
+        for (size_t s = 0; s < freq.size(); s++) {
+            if (freq[s] > 0) queue.push({freq[s], static_cast<int>(s)});
+        }
+        int next = static_cast<int>(freq.size());
+        while (queue.size() > 1) {
+            Node a = queue.top();
+            queue.pop();
+            Node b = queue.top();
+            queue.pop();
+            parent[a.second] = parent[b.second] = next;
+            queue.push({a.first + b.first, next++});
+        }
+        
+        code.lengths.assign(freq.size(), 0);
+        int longest = 0;
+        for (size_t s = 0; s < freq.size(); s++) {
+            if (freq[s] == 0) continue;
+            for (int node = static_cast<int>(s); parent[node] >= 0; node = parent[node]) {
+                code.lengths[s]++;
+            }
+            longest = std::max(longest, code.lengths[s]);
+        }
+        if (longest <= limit) break;
+        for (uint32_t& f : freq) {
+            if (f > 0) f = (f + 1) / 2;
+        }
+    }
+    assignCodes(code);
+    return code;
+}
+
+// Canonical codes (RFC 1951 3.2.2), bit-reversed for LSB-first output
+void InflateTest::assignCodes(Code& code) {
+    int count[16] = {0};
+    for (int length : code.lengths) count[length]++;
+    count[0] = 0;
+    uint32_t next[16] = {0};
+    for (int bits = 1, value = 0; bits < 16; bits++) {
+        value = (value + count[bits - 1]) << 1;
+        next[bits] = value;
+    }
+    
+    code.codes.assign(code.lengths.size(), 0);
+    for (size_t s = 0; s < code.lengths.size(); s++) {
+        int length = code.lengths[s];
+        if (length == 0) continue;
+        uint32_t value = next[length]++, reversed = 0;
+        for (int i = 0; i < length; i++) reversed |= ((value >> i) & 1) << (length - 1 - i);
+        code.codes[s] = reversed;
+    }
+}
+
+void InflateTest::writeTokens(BitWriter& out, const Token* tokens, size_t count, const Code& litLen,
+                              const Code& dist) {
+    for (size_t i = 0; i < count; i++) {
+        const Token& token = tokens[i];
+        if (token.length == 0) {
+            litLen.write(out, token.literal);
+            continue;
+        }
+        int l = lengthSymbol(token.length);
+        litLen.write(out, 257 + l);
+        out.writeBits(token.length - kLengthBase[l], kLengthExtra[l]);
+        int d = distSymbol(token.distance);
+        dist.write(out, d);
+        out.writeBits(token.distance - kDistBase[d], kDistExtra[d]);
+    }
+    litLen.write(out, 256);
+}
+
+void InflateTest::writeDynamicBlock(BitWriter& out, const Token* tokens, size_t count) {
+    std::vector<uint32_t> litFreq(286, 0), distFreq(30, 0);
+    for (size_t i = 0; i < count; i++) {
+        if (tokens[i].length == 0) {
+            litFreq[tokens[i].literal]++;
+        } else {
+            litFreq[257 + lengthSymbol(tokens[i].length)]++;
+            distFreq[distSymbol(tokens[i].distance)]++;
+        }
+    }
+    litFreq[256] = 1;
+    Code litLen = buildCode(litFreq, 15);
+    Code dist = buildCode(distFreq, 15);
+    
+    int hlit = 286, hdist = 30;
+    while (litLen.lengths[hlit - 1] == 0) hlit--;
+    while (dist.lengths[hdist - 1] == 0) hdist--;
+    std::vector<int> lengths(litLen.lengths.begin(), litLen.lengths.begin() + hlit);
+    lengths.insert(lengths.end(), dist.lengths.begin(), dist.lengths.begin() + hdist);
+    
+    // Run-length code the lengths with symbols 16 (repeat), 17 and 18 (zeros)
+    std::vector<std::pair<int, int>> runs; // symbol, extra bits value
+    for (size_t i = 0; i < lengths.size();) {
+        size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == lengths[i]) run++;
+        if (lengths[i] == 0 && run >= 3) {
+            run = std::min<size_t>(run, 138);
+            runs.push_back(run >= 11 ? std::make_pair(18, static_cast<int>(run) - 11)
+                                     : std::make_pair(17, static_cast<int>(run) - 3));
+        } else if (lengths[i] != 0 && run >= 4) {
+            run = std::min<size_t>(run, 7);
+            runs.push_back({lengths[i], 0});
+            runs.push_back({16, static_cast<int>(run) - 4});
+        } else {
+            run = 1;
+            runs.push_back({lengths[i], 0});
+        }
+        i += run;
+    }
+    
+    std::vector<uint32_t> lengthFreq(19, 0);
+    for (const auto& run : runs) lengthFreq[run.first]++;
+    Code lengthCode = buildCode(lengthFreq, 7);
+    int hclen = 19;
+    while (lengthCode.lengths[kCodeLengthOrder[hclen - 1]] == 0) hclen--;
+    hclen = std::max(hclen, 4);
+    
+    out.writeBits(2, 2);
+    out.writeBits(hlit - 257, 5);
+    out.writeBits(hdist - 1, 5);
+    out.writeBits(hclen - 4, 4);
+    for (int i = 0; i < hclen; i++) {
+        out.writeBits(lengthCode.lengths[kCodeLengthOrder[i]], 3);
+    }
+    for (const auto& run : runs) {
+        lengthCode.write(out, run.first);
+        if (run.first == 16) out.writeBits(run.second, 2);
+        if (run.first == 17) out.writeBits(run.second, 3);
+        if (run.first == 18) out.writeBits(run.second, 7);
+    }
+    writeTokens(out, tokens, count, litLen, dist);
+}
+
+// A zlib stream of blocks of random size, of the mode's type or, for Mixed,
+// of any type
+std::vector<uint8_t> InflateTest::compress(const std::vector<uint8_t>& data, Mode mode,
+                                           std::mt19937& rng) {
+    std::vector<Token> tokens = tokenize(data, mode == Mode::RLE);
+    
+    Code fixedLitLen, fixedDist;
+    fixedLitLen.lengths.assign(288, 8);
+    std::fill(fixedLitLen.lengths.begin() + 144, fixedLitLen.lengths.begin() + 256, 9);
+    std::fill(fixedLitLen.lengths.begin() + 256, fixedLitLen.lengths.begin() + 280, 7);
+    fixedDist.lengths.assign(30, 5);
+    assignCodes(fixedLitLen);
+    assignCodes(fixedDist);
+    
+    BitWriter out;
+    out.bytes = {0x78, 0x9C};
+    size_t pos = 0; // in data, where tokens[t] starts
+    for (size_t t = 0; t < tokens.size();) {
+        size_t count = std::min<size_t>(tokens.size() - t, 200 + rng() % 8000);
+        size_t bytes = 0;
+        for (size_t i = t; i < t + count; i++) bytes += tokens[i].length ? tokens[i].length : 1;
+        
+        Mode type = mode;
+        if (type == Mode::Mixed) type = static_cast<Mode>(rng() % 4);
+        if (type == Mode::Stored) {
+            // Bytes rather than tokens, at most 65535 per block
+            count = 0;
+            bytes = 0;
+            while (t + count < tokens.size() && bytes < 65535 - 258) {
+                bytes += tokens[t + count].length ? tokens[t + count].length : 1;
+                count++;
+            }
+        }
+        bool last = t + count == tokens.size();
+        out.writeBits(last ? 1 : 0, 1);
+        
+        if (type == Mode::Stored) {
+            writeStoredBlock(out, data.data() + pos, bytes);
+        } else if (type == Mode::Fixed) {
+            out.writeBits(1, 2);
+            writeTokens(out, &tokens[t], count, fixedLitLen, fixedDist);
+        } else {
+            writeDynamicBlock(out, &tokens[t], count);
+        }
+        t += count;
+        pos += bytes;
+    }
+    out.alignToByte();
+    
+    appendAdler32(out.bytes, data);
+    return out.bytes;
+}
+
+// Stored blocks holding raw deflate data of their own, in small dynamic
+// blocks ended by an empty stored block so it stops on a byte boundary,
+// each followed by a real dynamic block. A decode started at one of the
+// inner block headers runs on in step into the real blocks, so it passes
+// for a chunk start. `data` gets the decompressed stream.
+std::vector<uint8_t> InflateTest::nestedStream(std::mt19937& rng, std::vector<uint8_t>& data) {
+    BitWriter out;
+    out.bytes = {0x78, 0x9C};
+    data.clear();
+    const int segments = 24;
+    for (int segment = 0; segment < segments; segment++) {
+        std::vector<uint8_t> piece = sampleData(rng, 4096 + rng() % 16384);
+        std::vector<Token> tokens = tokenize(piece, false);
+        BitWriter inner;
+        for (size_t t = 0; t < tokens.size();) {
+            size_t count = std::min<size_t>(tokens.size() - t, 50 + rng() % 100);
+            inner.writeBits(0, 1);
+            writeDynamicBlock(inner, &tokens[t], count);
+            t += count;
+        }
+        inner.writeBits(0, 1);
+        writeStoredBlock(inner, nullptr, 0);
+        
+        out.writeBits(0, 1);
+        writeStoredBlock(out, inner.bytes.data(), inner.bytes.size());
+        data.insert(data.end(), inner.bytes.begin(), inner.bytes.end());
+        
+        std::vector<uint8_t> real = sampleData(rng, 1024 + rng() % 8192);
+        tokens = tokenize(real, false);
+        out.writeBits(segment == segments - 1 ? 1 : 0, 1);
+        writeDynamicBlock(out, tokens.data(), tokens.size());
+        data.insert(data.end(), real.begin(), real.end());
+    }
+    out.alignToByte();
+    appendAdler32(out.bytes, data);
+    return out.bytes;
+}
+
+// The block type and payload; BFINAL is up to the caller
+void InflateTest::writeStoredBlock(BitWriter& out, const uint8_t* data, size_t size) {
+    out.writeBits(0, 2);
+    out.alignToByte();
+    out.writeBits(static_cast<uint32_t>(size), 16);
+    out.writeBits(static_cast<uint32_t>(size) ^ 0xFFFF, 16);
+    out.bytes.insert(out.bytes.end(), data, data + size);
+}
+
+// Spans of 1 byte to 16 KiB, like IDAT chunks of any size
+std::vector<Deflate::Span> InflateTest::split(const std::vector<uint8_t>& stream, std::mt19937& rng) {
+    std::vector<Deflate::Span> spans;
+    for (size_t pos = 0; pos < stream.size();) {
+        size_t size = std::min<size_t>(stream.size() - pos, rng() % 4 == 0 ? 1 + rng() % 16 : 1 + rng() % 16384);
+        spans.push_back({stream.data() + pos, size});
+        pos += size;
+    }
+    return spans;
+}
+
+int InflateTest::run() {
+    static const char* const modeNames[] = {"stored", "fixed", "rle", "dynamic", "mixed", "nested"};
+    std::mt19937 rng(2024);
+    bool ok = true;
+    size_t speculated = 0, redecoded = 0;
+    
+    for (int m = 0; m < 6; m++) {
+        Mode mode = static_cast<Mode>(m);
+        for (size_t chunkBytes : {size_t(512), size_t(4096), size_t(65536)}) {
+            std::vector<uint8_t> data = sampleData(rng, 512 * 1024);
+            std::vector<uint8_t> stream =
+                mode == Mode::Nested ? nestedStream(rng, data) : compress(data, mode, rng);
+            std::vector<Deflate::Span> spans = split(stream, rng);
+            
+            std::vector<uint8_t> serial(data.size()), parallel(data.size());
+            Deflate::inflate(spans, serial.data(), serial.size());
+            Deflate::ChunkStats stats =
+                Deflate::inflateChunked(spans, parallel.data(), parallel.size(), 4, chunkBytes);
+            
+            bool same = serial == data && parallel == serial;
+            ok &= same;
+            speculated += stats.chunks - 1 - stats.redecoded;
+            redecoded += stats.redecoded;
+            std::printf("%-8s %7zu bytes in %6zu-byte chunks: %4zu chunks, %4zu decoded again %s\n",
+                        modeNames[m], stream.size(), chunkBytes, stats.chunks, stats.redecoded,
+                        same ? "ok" : "MISMATCH");
+        }
+    }
+    
+    // Both ways a chunk can end up in the output have to have been taken
+    std::printf("speculative chunks taken %zu, decoded again %zu\n", speculated, redecoded);
+    if (speculated == 0 || redecoded == 0) {
+        std::printf("FAILED: did not exercise both paths\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
+
+int main() {
+    try {
+        return InflateTest::run();
+    } catch (const std::exception& e) {
+        std::printf("FAILED: %s\n", e.what());
+        return 1;
+    }
+}